@@ -2,6 +2,7 @@
 #include "karray.h"
 #include "node.h"
 #include <stdio.h>
+#include <string.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,9 +61,40 @@ AstMachine *AstMachine_init(unsigned log_size, const char *source)
     ast->last_linked = NULL;
     ast->source = source;
     ast->parsed = NULL;
+    ast->mode = AST_MODE_TREE;
+    ast->events = NULL;
+    ast->base = ast->flushed = 0;
     return ast;
 }
 
+void AstMachine_reset(AstMachine *ast)
+{
+    ast_rollback_tx(ast, 0);
+    ast->base = ast->flushed = 0;
+    ast->last_linked = NULL;
+    ast->parsed = NULL;
+}
+
+void AstMachine_setMode(AstMachine *ast, ast_mode_t mode, const AstEvents *events)
+{
+    AstMachine_reset(ast);
+    ast->mode = mode;
+    ast->events = events;
+}
+
+static const char *ast_mode_names[] = { "tree", "event", "recognize" };
+
+int ast_mode_parse(const char *name)
+{
+    unsigned i;
+    for (i = 0; i < sizeof(ast_mode_names) / sizeof(ast_mode_names[0]); i++) {
+        if (strcmp(name, ast_mode_names[i]) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
 void AstMachine_dispose(AstMachine *ast)
 {
     ast_rollback_tx(ast, 0);
@@ -122,12 +154,15 @@ static void AstMachine_dumpLog(AstMachine *ast)
 #endif
 
 #ifdef AST_DEBUG
-static unsigned last_id = 1;
+static MOZVM_THREAD_LOCAL unsigned last_id = 1;
 #endif
 
 static void ast_log(AstMachine *ast, AstLogType type, mozpos_t pos, uintptr_t val)
 {
     AstLog *log;
+    if (ast->mode == AST_MODE_RECOGNIZE) {
+        return;
+    }
     ARRAY_ensureSize(AstLog, &ast->logs, 1);
     log = ARRAY_END(ast->logs);
     SetTag(log, type);
@@ -171,6 +206,14 @@ void ast_log_push(AstMachine *ast)
     ast_log(ast, TypePush, 0, 0);
 }
 
+long ast_start_tx(AstMachine *ast)
+{
+    if (ast->mode == AST_MODE_EVENT) {
+        ast_log(ast, TypePush, 0, 0);
+    }
+    return ast_save_tx(ast);
+}
+
 void ast_log_pop(AstMachine *ast, const char *tag)
 {
     ast_log(ast, TypePop, (mozpos_t)tag, 0);
@@ -179,6 +222,9 @@ void ast_log_pop(AstMachine *ast, const char *tag)
 void ast_log_link(AstMachine *ast, const char *tag, Node *node)
 {
     union ast_log_index i;
+    if (ast->mode == AST_MODE_RECOGNIZE) {
+        return;
+    }
     i.tag = tag;
     if (node) {
         NODE_GC_RETAIN(node);
@@ -187,9 +233,33 @@ void ast_log_link(AstMachine *ast, const char *tag, Node *node)
     ast->last_linked = node;
 }
 
+void ast_log_splice(AstMachine *ast, const AstLog *logs, unsigned n)
+{
+    AstLog *cur, *tail;
+    if (ast->mode == AST_MODE_RECOGNIZE) {
+        return;
+    }
+    ARRAY_ensureSize(AstLog, &ast->logs, n);
+    cur = ARRAY_END(ast->logs);
+    memcpy(cur, logs, sizeof(AstLog) * n);
+    ARRAY_size(ast->logs) += n;
+    tail = ARRAY_END(ast->logs);
+    for (; cur < tail; ++cur) {
+        if (GetTag(cur) == TypeLink && GetNode(cur)) {
+            NODE_GC_RETAIN(GetNode(cur));
+            ast->last_linked = GetNode(cur);
+        }
+    }
+}
+
 void ast_rollback_tx(AstMachine *ast, long tx)
 {
     unsigned len = ARRAY_size(ast->logs);
+    /* only the failure of a whole parse goes below base */
+    tx = tx > ast->base ? tx - ast->base : 0;
+    if (ast->flushed > ast->base + tx) {
+        ast->flushed = ast->base + tx;
+    }
     if (tx < len) {
         AstLog *cur = ARRAY_n(ast->logs, tx);
         AstLog *tail = ARRAY_last(ast->logs);
@@ -304,17 +374,67 @@ static Node *ast_create_node(AstMachine *ast, AstLog *cur, AstLog *pushed)
             objSize++;
             cur += shift;
             break;
+        case TypeLeaf:
+            /* only logged in AST_MODE_EVENT */
+            break;
         }
     }
     tmp = constructLeft(ast, head, tail, spos, epos, objSize, tag, value);
     return tmp;
 }
 
+/*
+ * AST_MODE_EVENT: most children are leaves, logged as TypePush, TypeNew,
+ * TypeTag and TypeCapture. Unless their events have begun, they are
+ * folded into one TypeLeaf with the tag in i, the start in e, the length
+ * in shift and the label in label.
+ */
+static int ast_commit_leaf(AstMachine *ast, const char *label, long tx)
+{
+    AstLog *cur = ARRAY_END(ast->logs) - 1;
+    AstLog *head = ARRAY_n(ast->logs, tx - ast->base);
+    const char *tag = NULL;
+    mozpos_t epos;
+    if (tx - 1 < ast->flushed || cur - head < 1 || cur - head > 2 ||
+            GetTag(head - 1) != TypePush || GetTag(head) != TypeNew) {
+        return 0;
+    }
+    if (GetTag(cur) == TypeTag) {
+        tag = cur->i.tag;
+        cur--;
+    }
+    if (GetTag(cur) != TypeCapture) {
+        return 0;
+    }
+    epos = cur->i.pos;
+    if (cur - head == 2) {
+        if (tag != NULL || GetTag(cur - 1) != TypeTag) {
+            return 0;
+        }
+        tag = cur[-1].i.tag;
+    }
+    cur = head - 1;
+    cur->e.val = (uintptr_t)head->i.pos;
+    cur->shift = epos - head->i.pos;
+    cur->i.tag = tag;
+    cur->label = label;
+    SetTag(cur, TypeLeaf);
+    ARRAY_size(ast->logs) = head - ARRAY_BEGIN(ast->logs);
+    return 1;
+}
+
 void ast_commit_tx(AstMachine *ast, const char *tag, long tx)
 {
     AstLog *cur;
-    assert(ARRAY_size(ast->logs) > tx);
-    cur = ARRAY_get(AstLog, &ast->logs, tx);
+    if (ast->mode != AST_MODE_TREE) {
+        /* the child stays in the log, closed like TPush and TPop */
+        if (ast->mode == AST_MODE_EVENT && !ast_commit_leaf(ast, tag, tx)) {
+            ast_log(ast, TypePop, (mozpos_t)tag, 0);
+        }
+        return;
+    }
+    assert(ast_save_tx(ast) > tx);
+    cur = ARRAY_get(AstLog, &ast->logs, tx - ast->base);
 #ifdef AST_DEBUG
     fprintf(stderr, "0: %ld %d\n", tx, ARRAY_size(ast->logs)-1);
     AstMachine_dumpLog(ast);
@@ -326,6 +446,81 @@ void ast_commit_tx(AstMachine *ast, const char *tag, long tx)
     }
 }
 
+#define AST_EMIT(EV, FN, ARG) do { \
+    if ((EV)->FN) { \
+        (EV)->FN((EV)->ctx, ARG); \
+    } \
+} while (0)
+
+static void ast_emit_events(const AstEvents *ev, AstLog *cur, AstLog *tail)
+{
+    for (; cur < tail; ++cur) {
+        switch (GetTag(cur)) {
+        case TypeNew:
+            AST_EMIT(ev, on_new, cur->i.pos);
+            break;
+        case TypeCapture:
+            AST_EMIT(ev, on_capture, cur->i.pos);
+            break;
+        case TypeTag:
+            AST_EMIT(ev, on_tag, cur->i.tag);
+            break;
+        case TypeReplace:
+            AST_EMIT(ev, on_replace, cur->i.tag);
+            break;
+        case TypeLeftFold:
+            AST_EMIT(ev, on_fold, cur->i.pos);
+            break;
+        case TypePush:
+            if (ev->on_link) {
+                ev->on_link(ev->ctx);
+            }
+            break;
+        case TypePop:
+            AST_EMIT(ev, on_pop, cur->i.tag);
+            break;
+        case TypeLeaf:
+            if (ev->on_link) {
+                ev->on_link(ev->ctx);
+            }
+            AST_EMIT(ev, on_new, (mozpos_t)cur->e.val);
+            if (cur->i.tag) {
+                AST_EMIT(ev, on_tag, cur->i.tag);
+            }
+            AST_EMIT(ev, on_capture, (mozpos_t)cur->e.val + cur->shift);
+            AST_EMIT(ev, on_pop, cur->label);
+            break;
+        case TypeLink:
+            /* only a memoized node, which TLookup does not use here */
+            break;
+        }
+    }
+}
+
+/*
+ * Fires the events of the logs up to tx. The log keeps the transactions
+ * the VM holds, so the logs are not dropped one by one; once the fired
+ * ones fill half of it, the rest is moved down over them and base moves
+ * up.
+ */
+void ast_flush_events(AstMachine *ast, long tx)
+{
+    AstLog *logs = ARRAY_BEGIN(ast->logs);
+    long n = tx - ast->base;
+    if (tx <= ast->flushed) {
+        return;
+    }
+    if (ast->events) {
+        ast_emit_events(ast->events, logs + (ast->flushed - ast->base), logs + n);
+    }
+    ast->flushed = tx;
+    if (n * 2 >= (long)ARRAY_size(ast->logs)) {
+        ARRAY_size(ast->logs) -= n;
+        memmove(logs, logs + n, sizeof(AstLog) * ARRAY_size(ast->logs));
+        ast->base = tx;
+    }
+}
+
 Node *ast_get_parsed_node(AstMachine *ast)
 {
     AstLog *cur, *tail;
@@ -333,6 +528,11 @@ Node *ast_get_parsed_node(AstMachine *ast)
     if (ast->parsed) {
         return ast->parsed;
     }
+    if (ast->mode != AST_MODE_TREE) {
+        ast_flush_events(ast, ast_save_tx(ast));
+        ast_rollback_tx(ast, ast->base);
+        return NULL;
+    }
 #ifdef AST_DEBUG
     AstMachine_dumpLog(ast);
 #endif
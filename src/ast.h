@@ -19,6 +19,7 @@ typedef enum AstLogType {
     TypeNew      = 6,
     TypeLink     = 7,
     TypeCapture  = 8,
+    TypeLeaf     = 9,
 } AstLogType;
 
 // #define AST_DEBUG 1
@@ -50,17 +51,55 @@ typedef struct AstLog {
 DEF_ARRAY_STRUCT0(AstLog, unsigned);
 DEF_ARRAY_T(AstLog);
 
+typedef enum ast_mode_t {
+    AST_MODE_TREE,      /* build a tree of Node (default) */
+    AST_MODE_EVENT,     /* replay the logs through AstEvents, build nothing */
+    AST_MODE_RECOGNIZE  /* T* instructions do nothing */
+} ast_mode_t;
+
+/*
+ * Callbacks of AST_MODE_EVENT, fired in input order for the logs that no
+ * backtracking can drop any more (see ast_flush_events()), so a subtree
+ * that is rolled back never reaches them; a parse that fails as a whole
+ * may have fired the events of its prefix, as a SAX parser does. A node
+ * starts with on_new and gets its tag and end from on_tag and on_capture
+ * (the last one wins, as in the tree). A linked child starts at on_link
+ * and ends at the matching on_pop, which gives its label. on_replace and
+ * on_fold report the rarer value replacement and left fold (the current
+ * node becomes the first child of a node starting at pos). Any callback
+ * may be NULL.
+ */
+typedef struct AstEvents {
+    void *ctx;
+    void (*on_new)(void *ctx, mozpos_t pos);
+    void (*on_tag)(void *ctx, const char *tag);
+    void (*on_capture)(void *ctx, mozpos_t pos);
+    void (*on_link)(void *ctx);
+    void (*on_pop)(void *ctx, const char *label);
+    void (*on_replace)(void *ctx, const char *value);
+    void (*on_fold)(void *ctx, mozpos_t pos);
+} AstEvents;
+
 struct AstMachine {
     ARRAY(AstLog) logs;
     Node *last_linked;
     Node *parsed;
     const char *source;
+    ast_mode_t mode;
+    const AstEvents *events;
+    long base;    /* transaction of logs.list[0]; see ast_flush_events() */
+    long flushed; /* the events below it have been fired */
 };
 
 typedef struct AstMachine AstMachine;
 
 AstMachine *AstMachine_init(unsigned log_size, const char *source);
 void AstMachine_dispose(AstMachine *ast);
+/* drop the logs of the previous parse; the log buffer and mode are kept */
+void AstMachine_reset(AstMachine *ast);
+/* events is only used by AST_MODE_EVENT; call it between parses */
+void AstMachine_setMode(AstMachine *ast, ast_mode_t mode, const AstEvents *events);
+int ast_mode_parse(const char *name);
 static inline void AstMachine_setSource(AstMachine *ast, const char *source)
 {
     ast->source = source;
@@ -68,9 +107,12 @@ static inline void AstMachine_setSource(AstMachine *ast, const char *source)
 
 static inline long ast_save_tx(AstMachine *ast)
 {
-    return ARRAY_size(ast->logs);
+    return ast->base + ARRAY_size(ast->logs);
 }
 
+/* TStart; AST_MODE_EVENT logs where the linked child starts */
+long ast_start_tx(AstMachine *ast);
+
 void ast_rollback_tx(AstMachine *ast, long tx);
 void ast_commit_tx(AstMachine *ast, const char *tag, long tx);
 void ast_log_replace(AstMachine *ast, const char *str);
@@ -81,12 +123,17 @@ void ast_log_push(AstMachine *ast);
 void ast_log_swap(AstMachine *ast, mozpos_t pos, const char *tag);
 void ast_log_tag(AstMachine *ast, const char *tag);
 void ast_log_link(AstMachine *ast, const char *label, Node *result);
+/* appends n logs recorded by another machine; linked nodes are retained */
+void ast_log_splice(AstMachine *ast, const AstLog *logs, unsigned n);
+/* AST_MODE_EVENT: the logs below tx can no longer be rolled back */
+void ast_flush_events(AstMachine *ast, long tx);
 
 static inline Node *ast_get_last_linked_node(AstMachine *ast)
 {
     return ast->last_linked;
 }
 
+/* fires the events in AST_MODE_EVENT; no tree is built outside AST_MODE_TREE */
 Node *ast_get_parsed_node(AstMachine *ast);
 #ifdef MOZVM_MEMORY_USE_MSGC
 void ast_trace(void *p, NodeVisitor *visitor);
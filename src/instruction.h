@@ -75,6 +75,14 @@ enum MozOpcode {
     TblJump3    = 57,  //
     // SkipJump = 55,
 
+    /* superinstructions (created by loader) */
+    AltByteSucc = 58,  // Alt; Byte; Succ
+    ByteRSet    = 59,  // Byte; RSet
+    Byte2       = 60,  // Byte; Byte
+    Str2        = 61,  // Str; Str
+    TTagCapture = 62,  // TTag; TCapture
+    TailCall    = 63,  // Call whose next instruction is Ret
+
     Label    = 127,  // 7-bit
 };
 
@@ -138,8 +146,30 @@ enum MozOpcode {
     F(TblJump2)\
     F(TblJump3)\
     /*F(SkipJump)*/\
+    F(AltByteSucc)\
+    F(ByteRSet)\
+    F(Byte2)\
+    F(Str2)\
+    F(TTagCapture)\
+    F(TailCall)\
     F(Label)
 
+/* A superinstruction only replaces the opcode of the first instruction of
+ * a sequence, so its operands and the rest of the sequence are unchanged.
+ * TailCall has the same operands as Call. */
+static inline int opcode_base(int opcode)
+{
+    switch (opcode) {
+    case AltByteSucc: return Alt;
+    case ByteRSet:    return Byte;
+    case Byte2:       return Byte;
+    case Str2:        return Str;
+    case TTagCapture: return TTag;
+    case TailCall:    return Call;
+    }
+    return opcode;
+}
+
 #ifdef MOZVM_DUMP_OPCODE
 static const char *opcode2str(int opcode)
 {
@@ -2,350 +2,1309 @@
 
 #ifdef MOZVM_ENABLE_JIT
 #include "instruction.h"
+#include "pstring.h"
+#include "token.h"
+
+#include <cstddef>
+#include <pthread.h>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef MOZVM_JIT_USE_BACKGROUND_COMPILE
+#include <thread>
+#endif
 
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/MCJIT.h"
 
-
-#ifdef __cplusplus
-extern "C" {
+#if !defined(MOZVM_USE_POINTER_AS_POS_REGISTER) || defined(MOZVM_USE_DIRECT_THREADING)
+#error "jit requires MOZVM_USE_POINTER_AS_POS_REGISTER and 1-byte opcodes"
 #endif
 
 #define MOZVM_OPCODE_SIZE 1
 #include "vm_inst.h"
 
+/* stack frame layout (must be same as vm.c) */
+#ifndef FP_MAX
+#define FP_FP     0
+#define FP_POS    1
+#define FP_NEXT   2
+#define FP_AST    3
+#define FP_SYMTBL 4
+#define FP_MAX    (5)
+#endif
+
+// #define MOZVM_JIT_DUMP 1
+
 using namespace llvm;
 
+/* runtime helpers called from compiled code */
+static long jit_lookup(moz_runtime_t *runtime, mozpos_t pos, unsigned memoId, unsigned state)
+{
+    MemoEntry_t *entry;
+#ifdef MOZVM_USE_MEMO_POINTS
+    MemoPoint *mp = runtime->memo_points + memoId;
+#endif
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+    if (mp->disabled) {
+        return -1;
+    }
+#endif
+#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
+    if (mp->penalty) {
+        mp->penalty--;
+        return -1;
+    }
+#endif
+    entry = memo_get(runtime->memo, pos, memoId, state);
+    MEMO_POINT_LOOKUP(mp);
+    if (entry) {
+        if (entry->consumed == MEMO_ENTRY_FAILED) {
+            MEMO_POINT_FAIL_HIT(mp);
+            return -2;
+        }
+        MEMO_POINT_HIT(mp, entry->consumed);
+        return entry->consumed;
+    }
+#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
+    mp->penalty += MEMO_PENALTY;
+#endif
+    return -1;
+}
+
+static long jit_tlookup(moz_runtime_t *runtime, mozpos_t pos, unsigned memoId, unsigned state, const char *tag)
+{
+    MemoEntry_t *entry;
+#ifdef MOZVM_USE_MEMO_POINTS
+    MemoPoint *mp = runtime->memo_points + memoId;
+#endif
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+    if (mp->disabled) {
+        return -1;
+    }
+#endif
+#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
+    if (mp->penalty) {
+        mp->penalty--;
+        return -1;
+    }
+#endif
+    entry = memo_get(runtime->memo, pos, memoId, state);
+    MEMO_POINT_LOOKUP(mp);
+    if (entry && entry->consumed != MEMO_ENTRY_FAILED &&
+            runtime->ast->mode == AST_MODE_EVENT) {
+        /* a memoized node has no logs to replay */
+        entry = NULL;
+    }
+    if (entry) {
+        if (entry->consumed == MEMO_ENTRY_FAILED) {
+            MEMO_POINT_FAIL_HIT(mp);
+            return -2;
+        }
+        MEMO_POINT_HIT(mp, entry->consumed);
+        ast_log_link(runtime->ast, tag, memo_entry_result(runtime->memo, entry));
+        return entry->consumed;
+    }
+#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
+    mp->penalty += MEMO_PENALTY;
+#endif
+    return -1;
+}
+
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+#define JIT_MEMO_POINT_ENABLED(ID) (!runtime->memo_points[ID].disabled)
+#else
+#define JIT_MEMO_POINT_ENABLED(ID) 1
+#endif
+
+static void jit_memo(moz_runtime_t *runtime, mozpos_t pos, unsigned memoId, long length, unsigned state)
+{
+    if (!JIT_MEMO_POINT_ENABLED(memoId)) {
+        return;
+    }
+    memo_set(runtime->memo, pos, memoId, NULL, length, state, MEMO_REACH_UNKNOWN);
+}
+
+static void jit_tmemo(moz_runtime_t *runtime, mozpos_t pos, unsigned memoId, long length, unsigned state)
+{
+    Node *node;
+    if (!JIT_MEMO_POINT_ENABLED(memoId)) {
+        return;
+    }
+    node = ast_get_last_linked_node(runtime->ast);
+    memo_set(runtime->memo, pos, memoId, node, length, state, MEMO_REACH_UNKNOWN);
+}
+
+static void jit_memo_fail(moz_runtime_t *runtime, mozpos_t pos, unsigned memoId)
+{
+    if (!JIT_MEMO_POINT_ENABLED(memoId)) {
+        return;
+    }
+    memo_fail(runtime->memo, pos, memoId, MEMO_REACH_UNKNOWN);
+}
+
+static void jit_smask(moz_runtime_t *runtime, const char *tableName)
+{
+    symtable_add_symbol_mask(runtime->table, tableName);
+}
+
+static void jit_sdef(moz_runtime_t *runtime, const char *tableName, const char *start, const char *cur)
+{
+    token_t captured;
+    token_init(&captured, start, cur);
+    symtable_add_symbol(runtime->table, tableName, &captured);
+}
+
+static int jit_sexists(moz_runtime_t *runtime, const char *tableName)
+{
+    return symtable_has_symbol(runtime->table, tableName);
+}
+
+static long jit_smatch(moz_runtime_t *runtime, const char *tableName, const char *cur)
+{
+    token_t t;
+    if (symtable_get_symbol(runtime->table, tableName, &t)) {
+        if (token_equal_string(&t, cur)) {
+            return token_length(&t);
+        }
+    }
+    return -1;
+}
+
+static long jit_sis(moz_runtime_t *runtime, const char *tableName, const char *start, const char *cur)
+{
+    token_t t;
+    if (symtable_get_symbol(runtime->table, tableName, &t)) {
+        token_t captured;
+        token_init(&captured, start, cur);
+        if (token_equal(&t, &captured)) {
+            return token_length(&t);
+        }
+    }
+    return -1;
+}
+
+static long jit_sisa(moz_runtime_t *runtime, const char *tableName, const char *start, const char *cur)
+{
+    token_t captured;
+    token_init(&captured, start, cur);
+    if (!symtable_contains(runtime->table, tableName, &captured)) {
+        return -1;
+    }
+    return token_length(&captured);
+}
+
 class JitContext {
 public:
+    LLVMContext context;
     ExecutionEngine *EE;
-    StructType *runtimeType;
+    Type *voidTy;
+    IntegerType *i8Ty;
+    IntegerType *i32Ty;
+    IntegerType *i64Ty;
+    PointerType *ptrTy;   /* i8*  */
+    PointerType *stackTy; /* i64* */
     FunctionType *funcType;
-    ~JitContext() {};
+
+    /* guards nterm_entry[].state and the compile queue */
+    std::mutex lock;
+    /* the runtimes of a program may compile at the same time */
+    std::mutex compiling;
+#ifdef MOZVM_JIT_USE_BACKGROUND_COMPILE
+    /* started by the first request */
+    std::thread worker;
+    std::condition_variable cond;
+    std::deque<mozvm_nterm_entry_t *> queue;
+    bool stop;
+#endif
     JitContext();
+    ~JitContext();
+    bool createEngine();
 };
 
-JitContext::JitContext() {
-    Type *argTypes[2];
-    LLVMContext& context = getGlobalContext();
-
+JitContext::JitContext()
+{
     EE = NULL;
+#ifdef MOZVM_JIT_USE_BACKGROUND_COMPILE
+    stop = false;
+#endif
+    voidTy  = Type::getVoidTy(context);
+    i8Ty    = Type::getInt8Ty(context);
+    i32Ty   = Type::getInt32Ty(context);
+    i64Ty   = Type::getInt64Ty(context);
+    ptrTy   = Type::getInt8PtrTy(context);
+    stackTy = Type::getInt64PtrTy(context);
 
-    runtimeType = StructType::create(context, "moz_runtime_t");
-    argTypes[0] = runtimeType->getPointerTo();
-    argTypes[1] = Type::getInt8PtrTy(context);
+    // const char *nterm(moz_runtime_t *runtime, const char *cur, long *SP, long *FP)
+    Type *argTypes[] = { ptrTy, ptrTy, stackTy, stackTy };
+    funcType = FunctionType::get(ptrTy, argTypes, false);
+}
 
-    ArrayRef<Type *> argsRef(argTypes, 2);
-    funcType = FunctionType::get(Type::getInt8Ty(context), argsRef, false);
+JitContext::~JitContext()
+{
+    delete EE;
 }
 
-static inline JitContext *get_context(moz_runtime_t *r)
+/* created on first compilation to keep startup cost low for small inputs */
+bool JitContext::createEngine()
 {
-    return reinterpret_cast<JitContext *>(r->jit_context);
+    static std::once_flag initialized;
+    std::string error;
+    std::call_once(initialized, []() {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+    });
+    std::unique_ptr<Module> M(new Module("moz.jit", context));
+    M->setTargetTriple(sys::getProcessTriple());
+    EE = EngineBuilder(std::move(M))
+        .setEngineKind(EngineKind::JIT)
+        .setErrorStr(&error)
+        .setOptLevel(CodeGenOpt::Aggressive)
+        .create();
+    if (EE == NULL) {
+        fprintf(stderr, "jit: %s\n", error.c_str());
+        return false;
+    }
+    return true;
 }
 
-void mozvm_jit_init(moz_runtime_t *runtime)
+class JitCompiler {
+    JitContext *ctx;
+    moz_program_t *program;
+    std::unique_ptr<Module> M;
+    IRBuilder<> builder;
+    std::map<unsigned, Function *> functions;
+    std::vector<unsigned> worklist;
+    std::map<unsigned, GlobalVariable *> sets;
+
+    /* per function state */
+    Function *F;
+    Value *arg_runtime;
+    Value *arg_fp;
+    AllocaInst *CUR;
+    AllocaInst *SP;
+    AllocaInst *FP;
+    BasicBlock *failBB;
+    std::map<const moz_inst_t *, BasicBlock *> blocks;
+    /* fail targets of the Alts, by bytecode address; see FP_NEXT below */
+    std::map<const moz_inst_t *, BasicBlock *> resumes;
+
+public:
+    JitCompiler(JitContext *ctx, moz_program_t *program)
+        : ctx(ctx), program(program),
+          M(new Module("moz.nterm", ctx->context)), builder(ctx->context),
+          F(NULL), arg_runtime(NULL), arg_fp(NULL),
+          CUR(NULL), SP(NULL), FP(NULL), failBB(NULL) {
+        M->setTargetTriple(sys::getProcessTriple());
+        M->setDataLayout(ctx->EE->getDataLayout());
+    }
+
+    bool compile(unsigned nterm);
+    void optimize();
+    std::unique_ptr<Module> &module() { return M; }
+    const std::map<unsigned, Function *> &compiled() { return functions; }
+
+private:
+    Function *getFunction(unsigned nterm);
+    bool compileNterm(unsigned nterm, Function *F);
+    bool emitInst(const moz_inst_t *p, const moz_inst_t *next, bool *terminated);
+    void emitFailBlock();
+
+    /* utils */
+    Constant *getInt(uint64_t val) { return ConstantInt::get(ctx->i64Ty, val); }
+    Constant *getInt32(uint32_t val) { return ConstantInt::get(ctx->i32Ty, val); }
+    Constant *getPtr(const void *ptr) {
+        return ConstantExpr::getIntToPtr(getInt((uintptr_t)ptr), ctx->ptrTy);
+    }
+    BasicBlock *newBlock(const char *name) {
+        return BasicBlock::Create(ctx->context, name, F);
+    }
+    BasicBlock *getBlock(const moz_inst_t *target) {
+        std::map<const moz_inst_t *, BasicBlock *>::iterator itr = blocks.find(target);
+        return itr != blocks.end() ? itr->second : NULL;
+    }
+    Value *field(Value *base, size_t offset, Type *ty) {
+        Value *ptr = builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, base, offset);
+        return builder.CreateBitCast(ptr, ty->getPointerTo());
+    }
+    Value *loadField(Value *base, size_t offset, Type *ty) {
+        return builder.CreateLoad(ty, field(base, offset, ty));
+    }
+    Value *callC(void *fn, Type *ret, ArrayRef<Value *> args) {
+        std::vector<Type *> types;
+        for (size_t i = 0; i < args.size(); i++) {
+            types.push_back(args[i]->getType());
+        }
+        FunctionType *FT = FunctionType::get(ret, types, false);
+        Constant *callee = ConstantExpr::getIntToPtr(getInt((uintptr_t)fn), FT->getPointerTo());
+        return builder.CreateCall(FT, callee, args);
+    }
+
+    Value *getCur() { return builder.CreateLoad(ctx->ptrTy, CUR); }
+    void setCur(Value *v) { builder.CreateStore(v, CUR); }
+    void consume(Value *n) {
+        setCur(builder.CreateInBoundsGEP(ctx->i8Ty, getCur(), n));
+    }
+    Value *getChar(Value *cur, unsigned n = 0) {
+        Value *ptr = builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, n);
+        return builder.CreateLoad(ctx->i8Ty, ptr);
+    }
+    Value *getAst() {
+        return loadField(arg_runtime, offsetof(moz_runtime_t, ast), ctx->ptrTy);
+    }
+    Value *getSymtable() {
+        return loadField(arg_runtime, offsetof(moz_runtime_t, table), ctx->ptrTy);
+    }
+    Value *astSaveTx(Value *ast) {
+        Value *size = loadField(ast, offsetof(AstMachine, logs) + offsetof(ARRAY(AstLog), size), ctx->i32Ty);
+        Value *base = loadField(ast, offsetof(AstMachine, base), ctx->i64Ty);
+        return builder.CreateAdd(base, builder.CreateZExt(size, ctx->i64Ty));
+    }
+    Value *symtableSavepoint(Value *tbl) {
+        Value *size = loadField(tbl, offsetof(symtable_t, table) + offsetof(ARRAY(entry_t), size), ctx->i32Ty);
+        return builder.CreateZExt(size, ctx->i64Ty);
+    }
+
+    void push(Value *v) {
+        Value *sp = builder.CreateLoad(ctx->stackTy, SP);
+        builder.CreateStore(v, sp);
+        builder.CreateStore(builder.CreateConstInBoundsGEP1_64(ctx->i64Ty, sp, 1), SP);
+    }
+    Value *pop() {
+        Value *sp = builder.CreateLoad(ctx->stackTy, SP);
+        sp = builder.CreateConstInBoundsGEP1_64(ctx->i64Ty, sp, -1);
+        builder.CreateStore(sp, SP);
+        return builder.CreateLoad(ctx->i64Ty, sp);
+    }
+    Value *frameAt(Value *fp, unsigned idx) {
+        return builder.CreateConstInBoundsGEP1_64(ctx->i64Ty, fp, idx);
+    }
+    Value *popFrame(unsigned idx) {
+        /* pop frame and return FP[idx] of popped frame */
+        Value *fp = builder.CreateLoad(ctx->stackTy, FP);
+        Value *val = builder.CreateLoad(ctx->i64Ty, frameAt(fp, idx));
+        Value *prev = builder.CreateLoad(ctx->i64Ty, frameAt(fp, FP_FP));
+        builder.CreateStore(fp, SP);
+        builder.CreateStore(builder.CreateIntToPtr(prev, ctx->stackTy), FP);
+        return val;
+    }
+    Value *toPos(Value *v) { return builder.CreateIntToPtr(v, ctx->ptrTy); }
+    Value *toLong(Value *v) { return builder.CreatePtrToInt(v, ctx->i64Ty); }
+
+    /* leaves the nterm; the interpreter reports the stack overflow */
+    void overflowIf(Value *cond) {
+        BasicBlock *overflow = newBlock("overflow");
+        BasicBlock *cont = newBlock("");
+        builder.CreateCondBr(cond, overflow, cont);
+        builder.SetInsertPoint(overflow);
+        builder.CreateRet(getPtr(MOZVM_JIT_STACK_OVERFLOW));
+        builder.SetInsertPoint(cont);
+    }
+    void fail() { builder.CreateBr(failBB); }
+    void failIf(Value *cond) {
+        BasicBlock *cont = newBlock("");
+        builder.CreateCondBr(cond, failBB, cont);
+        builder.SetInsertPoint(cont);
+    }
+    /* AST_FLUSH() of vm.c */
+    void emitAstFlush(Value *ast) {
+        BasicBlock *flush = newBlock("ast.flush");
+        BasicBlock *cont = newBlock("");
+        Value *mode = loadField(ast, offsetof(AstMachine, mode), ctx->i32Ty);
+        Value *flushed = loadField(ast, offsetof(AstMachine, flushed), ctx->i64Ty);
+        Value *pending = builder.CreateSub(astSaveTx(ast), flushed);
+        builder.CreateCondBr(builder.CreateAnd(
+                    builder.CreateICmpEQ(mode, getInt32(AST_MODE_EVENT)),
+                    builder.CreateICmpSGE(pending, getInt(MOZ_AST_FLUSH_INTERVAL))),
+                flush, cont);
+        builder.SetInsertPoint(flush);
+        Value *args[] = { arg_runtime, builder.CreateLoad(ctx->stackTy, FP) };
+        callC((void *)moz_runtime_flush_events, ctx->voidTy, args);
+        builder.CreateBr(cont);
+        builder.SetInsertPoint(cont);
+    }
+    Value *matchSet(Value *c, unsigned setId);
+    Value *matchStr(Value *cur, const char *str, unsigned len, BasicBlock *unmatch);
+    bool emitTable(const moz_inst_t *next, const int *jumps);
+};
+
+/*
+ * An nterm using an instruction the vm does not implement either (OAny,
+ * RAny, TAbort, SIsDef, SDefNum, SCount) is left to the interpreter, and
+ * so is every nterm compiled together with it.
+ */
+static bool isCompilable(int opcode)
 {
-    InitializeNativeTarget();
-    InitializeNativeTargetAsmPrinter();
-    runtime->jit_context = reinterpret_cast<void *>(new JitContext());
+    switch (opcode) {
+    case OAny:
+    case RAny:
+    case TAbort:
+    case SIsDef:
+    case SDefNum:
+    case SCount:
+        return false;
+    case Label:
+        return true;
+    }
+    return opcode <= TblJump3;
 }
 
-void mozvm_jit_reset(moz_runtime_t *runtime)
+static inline uint8_t readU8(const moz_inst_t *&p)
 {
-    delete get_context(runtime);
-    runtime->jit_context = reinterpret_cast<void *>(new JitContext());
+    uint8_t v = *p;
+    p += sizeof(uint8_t);
+    return v;
 }
 
-void mozvm_jit_dispose(moz_runtime_t *runtime)
+template<typename T>
+static inline T readT(const moz_inst_t *&p)
 {
-    delete get_context(runtime);
-    runtime->jit_context = NULL;
+    T v;
+    memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return v;
 }
 
-moz_jit_func_t mozvm_jit_compile(moz_runtime_t *runtime, mozvm_nterm_entry_t *e)
+Function *JitCompiler::getFunction(unsigned nterm)
 {
-    JitContext *_ctx = get_context(runtime);
-    uint16_t nterm = e - runtime->nterm_entry;
+    std::map<unsigned, Function *>::iterator itr = functions.find(nterm);
+    if (itr != functions.end()) {
+        return itr->second;
+    }
+    std::string name("moz.");
+    name += program->C.nterms[nterm];
+    Function *func = Function::Create(ctx->funcType,
+            Function::ExternalLinkage, name, M.get());
+    functions[nterm] = func;
+    worklist.push_back(nterm);
+    return func;
+}
 
-    if(e->compiled_code) {
-        return e->compiled_code;
+bool JitCompiler::compile(unsigned nterm)
+{
+    getFunction(nterm);
+    while (!worklist.empty()) {
+        unsigned id = worklist.back();
+        worklist.pop_back();
+        if (!compileNterm(id, functions[id])) {
+            return false;
+        }
     }
+    return !verifyModule(*M, &errs());
+}
+
+void JitCompiler::optimize()
+{
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+    MPM.run(*M, MAM);
+}
 
-    LLVMContext& context = getGlobalContext();
-    IRBuilder<> builder(context);
-    Module *M = new Module("top", context);
-    if(_ctx->EE) {
-        _ctx->EE->addModule(std::unique_ptr<Module>(M));
+Value *JitCompiler::matchSet(Value *c, unsigned setId)
+{
+    GlobalVariable *table;
+    std::map<unsigned, GlobalVariable *>::iterator itr = sets.find(setId);
+    if (itr != sets.end()) {
+        table = itr->second;
     }
     else {
-        _ctx->EE = EngineBuilder(std::unique_ptr<Module>(M)).create();
+        bitset_t *set = BITSET_GET_IMPL(program, setId);
+        std::vector<Constant *> bits;
+        ArrayType *ty = ArrayType::get(ctx->i8Ty, 256);
+        for (unsigned i = 0; i < 256; i++) {
+            bits.push_back(ConstantInt::get(ctx->i8Ty, bitset_get(set, i)));
+        }
+        table = new GlobalVariable(*M, ty, true, GlobalValue::PrivateLinkage,
+                ConstantArray::get(ty, bits), "set");
+        sets[setId] = table;
+    }
+    Value *idx[] = { getInt(0), builder.CreateZExt(c, ctx->i64Ty) };
+    Value *ptr = builder.CreateInBoundsGEP(table->getValueType(), table, idx);
+    return builder.CreateICmpNE(builder.CreateLoad(ctx->i8Ty, ptr),
+            ConstantInt::get(ctx->i8Ty, 0));
+}
+
+/* emit byte-wise comparison; branch to unmatch on mismatch and continue
+ * in a new block when every byte matched */
+Value *JitCompiler::matchStr(Value *cur, const char *str, unsigned len, BasicBlock *unmatch)
+{
+    for (unsigned i = 0; i < len; i++) {
+        Value *c = getChar(cur, i);
+        Value *ok = builder.CreateICmpEQ(c, ConstantInt::get(ctx->i8Ty, (uint8_t)str[i]));
+        BasicBlock *cont = newBlock("");
+        builder.CreateCondBr(ok, cont, unmatch);
+        builder.SetInsertPoint(cont);
+    }
+    return builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, len);
+}
+
+bool JitCompiler::emitTable(const moz_inst_t *next, const int *jumps)
+{
+    std::map<int, unsigned> count;
+    int defaultJump = jumps[0];
+    for (unsigned i = 0; i < 256; i++) {
+        if (++count[jumps[i]] > count[defaultJump]) {
+            defaultJump = jumps[i];
+        }
+    }
+    BasicBlock *defaultBB = getBlock(next + defaultJump);
+    if (defaultBB == NULL) {
+        return false;
+    }
+    Value *c = getChar(getCur());
+    SwitchInst *sw = builder.CreateSwitch(c, defaultBB, 256);
+    for (unsigned i = 0; i < 256; i++) {
+        if (jumps[i] == defaultJump) {
+            continue;
+        }
+        BasicBlock *target = getBlock(next + jumps[i]);
+        if (target == NULL) {
+            return false;
+        }
+        sw->addCase(ConstantInt::get(ctx->i8Ty, i), target);
     }
+    return true;
+}
+
+void JitCompiler::emitFailBlock()
+{
+    builder.SetInsertPoint(failBB);
+    if (resumes.empty()) {
+        /* no choice point in this nterm */
+        builder.CreateRet(ConstantPointerNull::get(ctx->ptrTy));
+        return;
+    }
+    BasicBlock *exitBB   = newBlock("fail.exit");
+    BasicBlock *popBB    = newBlock("fail.pop");
+    BasicBlock *headBB   = newBlock("fail.head");
+    BasicBlock *astBB    = newBlock("fail.ast");
+    BasicBlock *rollback = newBlock("fail.rollback");
+    BasicBlock *resume   = newBlock("fail.resume");
+
+    Value *fp = builder.CreateLoad(ctx->stackTy, FP);
+    builder.CreateCondBr(builder.CreateICmpEQ(fp, arg_fp), exitBB, popBB);
+
+    builder.SetInsertPoint(exitBB);
+    builder.CreateRet(ConstantPointerNull::get(ctx->ptrTy));
 
-    Function *F = Function::Create(_ctx->funcType,
-            Function::ExternalLinkage,
-            runtime->C.nterms[nterm], M);
+    builder.SetInsertPoint(popBB);
+    Value *pos  = toPos(builder.CreateLoad(ctx->i64Ty, frameAt(fp, FP_POS)));
+    Value *next = builder.CreateLoad(ctx->i64Ty, frameAt(fp, FP_NEXT));
+    Value *tx   = builder.CreateLoad(ctx->i64Ty, frameAt(fp, FP_AST));
+    Value *save = builder.CreateLoad(ctx->i64Ty, frameAt(fp, FP_SYMTBL));
+    Value *prev = builder.CreateLoad(ctx->i64Ty, frameAt(fp, FP_FP));
+    builder.CreateStore(fp, SP);
+    builder.CreateStore(builder.CreateIntToPtr(prev, ctx->stackTy), FP);
+    Value *cur = getCur();
+    builder.CreateCondBr(builder.CreateICmpULT(pos, cur), headBB, astBB);
 
-    Function::arg_iterator arg_iter=F->arg_begin();
-    Value *runtime_ = arg_iter++;
-    Value *str = arg_iter++;
+    builder.SetInsertPoint(headBB);
+    Value *headPtr = field(arg_runtime, offsetof(moz_runtime_t, head), ctx->ptrTy);
+    Value *head = builder.CreateLoad(ctx->ptrTy, headPtr);
+    head = builder.CreateSelect(builder.CreateICmpULT(head, cur), cur, head);
+    builder.CreateStore(head, headPtr);
+    setCur(pos);
+    builder.CreateBr(astBB);
 
-    BasicBlock *entry = BasicBlock::Create(context, "entrypoint", F);
+    builder.SetInsertPoint(astBB);
+    Value *ast = getAst();
+    builder.CreateCondBr(builder.CreateICmpULT(tx, astSaveTx(ast)), rollback, resume);
+
+    builder.SetInsertPoint(rollback);
+    Value *args[] = { ast, tx };
+    callC((void *)ast_rollback_tx, ctx->voidTy, args);
+    builder.CreateBr(resume);
+
+    builder.SetInsertPoint(resume);
+    Value *tbl = getSymtable();
+    builder.CreateStore(builder.CreateTrunc(save, ctx->i32Ty),
+            field(tbl, offsetof(symtable_t, table) + offsetof(ARRAY(entry_t), size), ctx->i32Ty));
+    std::map<const moz_inst_t *, BasicBlock *>::iterator itr = resumes.begin();
+    SwitchInst *sw = builder.CreateSwitch(next, itr->second, resumes.size());
+    for (++itr; itr != resumes.end(); ++itr) {
+        sw->addCase(ConstantInt::get(ctx->i64Ty, (uintptr_t)itr->first), itr->second);
+    }
+}
+
+bool JitCompiler::compileNterm(unsigned nterm, Function *func)
+{
+    mozvm_nterm_entry_t *e = program->nterm_entry + nterm;
+    const moz_inst_t *p;
+
+    F = func;
+    blocks.clear();
+    resumes.clear();
+
+    Function::arg_iterator args = F->arg_begin();
+    arg_runtime = &*args++;
+    Value *arg_cur = &*args++;
+    Value *arg_sp  = &*args++;
+    arg_fp = &*args++;
+
+    BasicBlock *entry = newBlock("entry");
     builder.SetInsertPoint(entry);
+    CUR = builder.CreateAlloca(ctx->ptrTy, NULL, "cur");
+    SP  = builder.CreateAlloca(ctx->stackTy, NULL, "sp");
+    FP  = builder.CreateAlloca(ctx->stackTy, NULL, "fp");
+    builder.CreateStore(arg_cur, CUR);
+    builder.CreateStore(arg_sp, SP);
+    builder.CreateStore(arg_fp, FP);
+    /* a deep input recurses here without pushing any Alt frame */
+    Function *frameaddress = Intrinsic::getDeclaration(M.get(),
+            Intrinsic::frameaddress, ctx->ptrTy);
+    Value *frame = builder.CreateCall(frameaddress, getInt32(0));
+    Value *limit = loadField(arg_runtime, offsetof(moz_runtime_t, jit_stack_limit), ctx->ptrTy);
+    overflowIf(builder.CreateICmpULT(frame, limit));
 
-    moz_inst_t *p = e->begin;
-    while (p < e->end) {
-        uint8_t opcode = *p;
-        unsigned shift = opcode_size(opcode);
-        switch(opcode) {
-#define CASE_(OP) case OP:
-            CASE_(Nop) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Fail) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Succ) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Alt) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Jump) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Call) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Ret) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Pos) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Back) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Skip) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Byte) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(NByte) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(OByte) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(RByte) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Any) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(NAny) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(OAny) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(RAny) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Str) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(NStr) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(OStr) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(RStr) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Set) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(NSet) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(OSet) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(RSet) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Consume) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(First) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TblJump1) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TblJump2) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TblJump3) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Lookup) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Memo) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(MemoFail) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TPush) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TPop) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TLeftFold) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TNew) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TCapture) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TTag) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TReplace) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TStart) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TCommit) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TAbort) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TLookup) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(TMemo) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(SOpen) {
-                asm volatile("int3");
-            }
-            CASE_(SClose) {
-                asm volatile("int3");
-            }
-            CASE_(SMask) {
-                asm volatile("int3");
-            }
-            CASE_(SDef) {
-                asm volatile("int3");
-            }
-            CASE_(SIsDef) {
-                asm volatile("int3");
-            }
-            CASE_(SExists) {
-                asm volatile("int3");
-            }
-            CASE_(SMatch) {
-                asm volatile("int3");
-            }
-            CASE_(SIs) {
-                asm volatile("int3");
-            }
-            CASE_(SIsa) {
-                asm volatile("int3");
-            }
-            CASE_(SDefNum) {
-                asm volatile("int3");
-            }
-            CASE_(SCount) {
-                asm volatile("int3");
-            }
-            CASE_(Exit) {
-                asm volatile("int3");
-                break;
-            }
-            CASE_(Label) {
-                asm volatile("int3");
-                break;
+    for (p = e->begin; p < e->end; p += opcode_size(*p)) {
+        if (!isCompilable(opcode_base(*p))) {
+            return false;
+        }
+        blocks[p] = newBlock("");
+    }
+    if (p != e->end || e->begin == e->end) {
+        return false;
+    }
+    failBB = newBlock("fail");
+    builder.CreateBr(blocks[e->begin]);
+
+    for (p = e->begin; p < e->end; p += opcode_size(*p)) {
+        const moz_inst_t *next = p + opcode_size(*p);
+        bool terminated = false;
+        builder.SetInsertPoint(blocks[p]);
+        if (!emitInst(p, next, &terminated)) {
+            return false;
+        }
+        if (!terminated) {
+            BasicBlock *nextBB = getBlock(next);
+            if (nextBB == NULL) {
+                return false;
             }
+            builder.CreateBr(nextBB);
+        }
+    }
+    emitFailBlock();
+    return true;
+}
+
+bool JitCompiler::emitInst(const moz_inst_t *p, const moz_inst_t *next, bool *terminated)
+{
+    uint8_t opcode = opcode_base(readU8(p));
+    switch (opcode) {
+#define CASE_(OP) case ::OP:
+    CASE_(Nop) {
+        break;
+    }
+    CASE_(Fail) {
+        fail();
+        *terminated = true;
+        break;
+    }
+    CASE_(Alt) {
+        mozaddr_t failjump = readT<mozaddr_t>(p);
+        const moz_inst_t *resume = next + failjump;
+        BasicBlock *target = getBlock(resume);
+        if (target == NULL) {
+            return false;
+        }
+        Value *sp = builder.CreateLoad(ctx->stackTy, SP);
+        Value *end = loadField(arg_runtime, offsetof(moz_runtime_t, stack_end), ctx->stackTy);
+        overflowIf(builder.CreateICmpUGT(frameAt(sp, MOZ_STACK_REDZONE), end));
+        Value *fp = builder.CreateLoad(ctx->stackTy, FP);
+        builder.CreateStore(toLong(fp), frameAt(sp, FP_FP));
+        builder.CreateStore(toLong(getCur()), frameAt(sp, FP_POS));
+        /* like the vm, so that moz_runtime_flush_events() can read it */
+        builder.CreateStore(getInt((uintptr_t)resume), frameAt(sp, FP_NEXT));
+        builder.CreateStore(astSaveTx(getAst()), frameAt(sp, FP_AST));
+        builder.CreateStore(symtableSavepoint(getSymtable()), frameAt(sp, FP_SYMTBL));
+        builder.CreateStore(sp, FP);
+        builder.CreateStore(frameAt(sp, FP_MAX), SP);
+        resumes[resume] = target;
+        break;
+    }
+    CASE_(Succ) {
+        popFrame(FP_POS);
+        break;
+    }
+    CASE_(Jump) {
+        mozaddr_t jump = readT<mozaddr_t>(p);
+        BasicBlock *target = getBlock(next + jump);
+        if (target == NULL) {
+            return false;
+        }
+        builder.CreateBr(target);
+        *terminated = true;
+        break;
+    }
+    CASE_(Call) {
+        uint16_t nterm = readT<uint16_t>(p);
+        mozaddr_t ret  = readT<mozaddr_t>(p);
+        mozaddr_t jump = readT<mozaddr_t>(p);
+        mozvm_nterm_entry_t *e = program->nterm_entry + nterm;
+        BasicBlock *retBB = getBlock(next + ret);
+        if (retBB == NULL || e->begin != next + jump) {
+            return false;
+        }
+        Value *callee;
+        if (e->compiled_code) {
+            callee = ConstantExpr::getIntToPtr(getInt((uintptr_t)e->compiled_code),
+                    ctx->funcType->getPointerTo());
+        }
+        else {
+            callee = getFunction(nterm);
+        }
+        Value *args[] = {
+            arg_runtime, getCur(),
+            builder.CreateLoad(ctx->stackTy, SP),
+            builder.CreateLoad(ctx->stackTy, FP)
+        };
+        Value *result = builder.CreateCall(ctx->funcType, callee, args);
+        overflowIf(builder.CreateICmpEQ(result, getPtr(MOZVM_JIT_STACK_OVERFLOW)));
+        failIf(builder.CreateIsNull(result));
+        setCur(result);
+        builder.CreateBr(retBB);
+        *terminated = true;
+        break;
+    }
+    CASE_(Ret) {
+        builder.CreateRet(getCur());
+        *terminated = true;
+        break;
+    }
+    CASE_(Pos) {
+        push(toLong(getCur()));
+        break;
+    }
+    CASE_(Back) {
+        setCur(toPos(pop()));
+        break;
+    }
+    CASE_(Skip) {
+#ifdef MOZVM_USE_NTERM
+        readT<uint16_t>(p);
+#endif
+        Value *fp  = builder.CreateLoad(ctx->stackTy, FP);
+        Value *pos = frameAt(fp, FP_POS);
+        Value *cur = toLong(getCur());
+        failIf(builder.CreateICmpEQ(builder.CreateLoad(ctx->i64Ty, pos), cur));
+        builder.CreateStore(cur, pos);
+        builder.CreateStore(astSaveTx(getAst()), frameAt(fp, FP_AST));
+        builder.CreateStore(symtableSavepoint(getSymtable()), frameAt(fp, FP_SYMTBL));
+        break;
+    }
+    CASE_(Byte) {
+        uint8_t ch = readU8(p);
+        Value *cur = getCur();
+        failIf(builder.CreateICmpNE(getChar(cur), ConstantInt::get(ctx->i8Ty, ch)));
+        setCur(builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, 1));
+        break;
+    }
+    CASE_(NByte) {
+        uint8_t ch = readU8(p);
+        failIf(builder.CreateICmpEQ(getChar(getCur()), ConstantInt::get(ctx->i8Ty, ch)));
+        break;
+    }
+    CASE_(OByte) {
+        uint8_t ch = readU8(p);
+        Value *cur = getCur();
+        Value *ok = builder.CreateICmpEQ(getChar(cur), ConstantInt::get(ctx->i8Ty, ch));
+        Value *adv = builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, 1);
+        setCur(builder.CreateSelect(ok, adv, cur));
+        break;
+    }
+    CASE_(RByte) {
+        uint8_t ch = readU8(p);
+        BasicBlock *loop = newBlock("rbyte");
+        BasicBlock *body = newBlock("rbyte.body");
+        BasicBlock *done = newBlock("rbyte.done");
+        builder.CreateBr(loop);
+        builder.SetInsertPoint(loop);
+        Value *cur = getCur();
+        Value *ok = builder.CreateICmpEQ(getChar(cur), ConstantInt::get(ctx->i8Ty, ch));
+        builder.CreateCondBr(ok, body, done);
+        builder.SetInsertPoint(body);
+        setCur(builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, 1));
+        builder.CreateBr(loop);
+        builder.SetInsertPoint(done);
+        break;
+    }
+    CASE_(Any) {
+        Value *cur = getCur();
+        Value *tail = loadField(arg_runtime, offsetof(moz_runtime_t, tail), ctx->ptrTy);
+        failIf(builder.CreateICmpEQ(cur, tail));
+        setCur(builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, 1));
+        break;
+    }
+    CASE_(NAny) {
+        Value *tail = loadField(arg_runtime, offsetof(moz_runtime_t, tail), ctx->ptrTy);
+        failIf(builder.CreateICmpNE(getCur(), tail));
+        break;
+    }
+    CASE_(Str) {
+        const char *str = STRING_GET_IMPL(program, readT<STRING_t>(p));
+        setCur(matchStr(getCur(), str, pstring_length(str), failBB));
+        break;
+    }
+    CASE_(NStr) {
+        const char *str = STRING_GET_IMPL(program, readT<STRING_t>(p));
+        BasicBlock *done = newBlock("nstr.done");
+        matchStr(getCur(), str, pstring_length(str), done);
+        fail();
+        builder.SetInsertPoint(done);
+        break;
+    }
+    CASE_(OStr) {
+        const char *str = STRING_GET_IMPL(program, readT<STRING_t>(p));
+        BasicBlock *done = newBlock("ostr.done");
+        setCur(matchStr(getCur(), str, pstring_length(str), done));
+        builder.CreateBr(done);
+        builder.SetInsertPoint(done);
+        break;
+    }
+    CASE_(RStr) {
+        const char *str = STRING_GET_IMPL(program, readT<STRING_t>(p));
+        BasicBlock *loop = newBlock("rstr");
+        BasicBlock *done = newBlock("rstr.done");
+        builder.CreateBr(loop);
+        builder.SetInsertPoint(loop);
+        setCur(matchStr(getCur(), str, pstring_length(str), done));
+        builder.CreateBr(loop);
+        builder.SetInsertPoint(done);
+        break;
+    }
+    CASE_(Set) {
+        uint16_t setId = readT<BITSET_t>(p);
+        Value *cur = getCur();
+        failIf(builder.CreateNot(matchSet(getChar(cur), setId)));
+        setCur(builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, 1));
+        break;
+    }
+    CASE_(NSet) {
+        uint16_t setId = readT<BITSET_t>(p);
+        failIf(matchSet(getChar(getCur()), setId));
+        break;
+    }
+    CASE_(OSet) {
+        uint16_t setId = readT<BITSET_t>(p);
+        Value *cur = getCur();
+        Value *ok = matchSet(getChar(cur), setId);
+        Value *adv = builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, 1);
+        setCur(builder.CreateSelect(ok, adv, cur));
+        break;
+    }
+    CASE_(RSet) {
+        uint16_t setId = readT<BITSET_t>(p);
+        BasicBlock *loop = newBlock("rset");
+        BasicBlock *body = newBlock("rset.body");
+        BasicBlock *done = newBlock("rset.done");
+        builder.CreateBr(loop);
+        builder.SetInsertPoint(loop);
+        Value *cur = getCur();
+        builder.CreateCondBr(matchSet(getChar(cur), setId), body, done);
+        builder.SetInsertPoint(body);
+        setCur(builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, cur, 1));
+        builder.CreateBr(loop);
+        builder.SetInsertPoint(done);
+        break;
+    }
+    CASE_(Consume) {
+        int8_t shift = readT<int8_t>(p);
+        consume(getInt((int64_t)shift));
+        break;
+    }
+    CASE_(First) {
+        int *jumps = JMPTBL_GET_IMPL(program, readT<JMPTBL_t>(p));
+        if (!emitTable(next, jumps)) {
+            return false;
+        }
+        *terminated = true;
+        break;
+    }
+#ifdef MOZVM_USE_JMPTBL
+    CASE_(TblJump1) {
+        jump_table1_t *tbl = program->C.jumps1 + readT<uint16_t>(p);
+        int jumps[256];
+        for (unsigned i = 0; i < 256; i++) {
+            jumps[i] = jump_table1_jump(tbl, i);
+        }
+        if (!emitTable(next, jumps)) {
+            return false;
+        }
+        *terminated = true;
+        break;
+    }
+    CASE_(TblJump2) {
+        jump_table2_t *tbl = program->C.jumps2 + readT<uint16_t>(p);
+        int jumps[256];
+        for (unsigned i = 0; i < 256; i++) {
+            jumps[i] = jump_table2_jump(tbl, i);
+        }
+        if (!emitTable(next, jumps)) {
+            return false;
+        }
+        *terminated = true;
+        break;
+    }
+    CASE_(TblJump3) {
+        jump_table3_t *tbl = program->C.jumps3 + readT<uint16_t>(p);
+        int jumps[256];
+        for (unsigned i = 0; i < 256; i++) {
+            jumps[i] = jump_table3_jump(tbl, i);
+        }
+        if (!emitTable(next, jumps)) {
+            return false;
+        }
+        *terminated = true;
+        break;
+    }
+#endif
+    CASE_(Lookup)
+    CASE_(TLookup) {
+        uint8_t state = readU8(p);
+        TAG_t tagId = 0;
+        if (opcode == TLookup) {
+            tagId = readT<TAG_t>(p);
+        }
+        uint16_t memoId = readT<uint16_t>(p);
+        mozaddr_t skip = readT<mozaddr_t>(p);
+        BasicBlock *skipBB = getBlock(next + skip);
+        BasicBlock *nextBB = getBlock(next);
+        if (skipBB == NULL || nextBB == NULL) {
+            return false;
+        }
+        Value *result;
+        if (opcode == TLookup) {
+            Value *args[] = { arg_runtime, getCur(), getInt32(memoId),
+                getInt32(state), getPtr(TAG_GET_IMPL(program, tagId)) };
+            result = callC((void *)jit_tlookup, ctx->i64Ty, args);
+        }
+        else {
+            Value *args[] = { arg_runtime, getCur(), getInt32(memoId), getInt32(state) };
+            result = callC((void *)jit_lookup, ctx->i64Ty, args);
+        }
+        BasicBlock *hit = newBlock("memo.hit");
+        SwitchInst *sw = builder.CreateSwitch(result, hit, 2);
+        sw->addCase(ConstantInt::get(ctx->i64Ty, -1), nextBB);
+        sw->addCase(ConstantInt::get(ctx->i64Ty, -2), failBB);
+        builder.SetInsertPoint(hit);
+        consume(result);
+        builder.CreateBr(skipBB);
+        *terminated = true;
+        break;
+    }
+    CASE_(Memo)
+    CASE_(TMemo) {
+        uint8_t state = readU8(p);
+        uint16_t memoId = readT<uint16_t>(p);
+        Value *pos = popFrame(FP_POS);
+        Value *length = builder.CreateSub(toLong(getCur()), pos);
+        Value *args[] = { arg_runtime, toPos(pos), getInt32(memoId), length, getInt32(state) };
+        callC(opcode == Memo ? (void *)jit_memo : (void *)jit_tmemo, ctx->voidTy, args);
+        break;
+    }
+    CASE_(MemoFail) {
+        uint8_t state = readU8(p);
+        uint16_t memoId = readT<uint16_t>(p);
+        Value *args[] = { arg_runtime, getCur(), getInt32(memoId) };
+        callC((void *)jit_memo_fail, ctx->voidTy, args);
+        fail();
+        *terminated = true;
+        (void)state;
+        break;
+    }
+    CASE_(TPush) {
+        Value *args[] = { getAst() };
+        callC((void *)ast_log_push, ctx->voidTy, args);
+        break;
+    }
+    CASE_(TPop) {
+        tag_t *tag = TAG_GET_IMPL(program, readT<TAG_t>(p));
+        Value *args[] = { getAst(), getPtr(tag) };
+        callC((void *)ast_log_pop, ctx->voidTy, args);
+        break;
+    }
+    CASE_(TLeftFold) {
+        uint8_t shift = readU8(p);
+        tag_t *tag = TAG_GET_IMPL(program, readT<TAG_t>(p));
+        Value *pos = builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, getCur(), shift);
+        Value *args[] = { getAst(), pos, getPtr(tag) };
+        callC((void *)ast_log_swap, ctx->voidTy, args);
+        break;
+    }
+    CASE_(TNew)
+    CASE_(TCapture) {
+        uint8_t shift = readU8(p);
+        Value *pos = builder.CreateConstInBoundsGEP1_64(ctx->i8Ty, getCur(), shift);
+        Value *args[] = { getAst(), pos };
+        callC(opcode == TNew ? (void *)ast_log_new : (void *)ast_log_capture,
+                ctx->voidTy, args);
+        break;
+    }
+    CASE_(TTag) {
+        tag_t *tag = TAG_GET_IMPL(program, readT<TAG_t>(p));
+        Value *args[] = { getAst(), getPtr(tag) };
+        callC((void *)ast_log_tag, ctx->voidTy, args);
+        break;
+    }
+    CASE_(TReplace) {
+        const char *str = STRING_GET_IMPL(program, readT<STRING_t>(p));
+        Value *args[] = { getAst(), getPtr(str) };
+        callC((void *)ast_log_replace, ctx->voidTy, args);
+        break;
+    }
+    CASE_(TStart) {
+        Value *args[] = { getAst() };
+        push(callC((void *)ast_start_tx, ctx->i64Ty, args));
+        break;
+    }
+    CASE_(TCommit) {
+        tag_t *tag = TAG_GET_IMPL(program, readT<TAG_t>(p));
+        Value *tx = pop();
+        Value *ast = getAst();
+        Value *args[] = { ast, getPtr(tag), tx };
+        callC((void *)ast_commit_tx, ctx->voidTy, args);
+        emitAstFlush(ast);
+        break;
+    }
+    CASE_(SOpen) {
+        push(symtableSavepoint(getSymtable()));
+        break;
+    }
+    CASE_(SClose) {
+        Value *saved = pop();
+        Value *args[] = { getSymtable(), saved };
+        callC((void *)symtable_rollback, ctx->voidTy, args);
+        break;
+    }
+    CASE_(SMask) {
+        tag_t *tableName = TBL_GET_IMPL(program, readT<TAG_t>(p));
+        push(symtableSavepoint(getSymtable()));
+        Value *args[] = { arg_runtime, getPtr(tableName) };
+        callC((void *)jit_smask, ctx->voidTy, args);
+        break;
+    }
+    CASE_(SDef) {
+        tag_t *tableName = TBL_GET_IMPL(program, readT<TAG_t>(p));
+        Value *start = toPos(pop());
+        Value *args[] = { arg_runtime, getPtr(tableName), start, getCur() };
+        callC((void *)jit_sdef, ctx->voidTy, args);
+        break;
+    }
+    CASE_(SExists) {
+        tag_t *tableName = TBL_GET_IMPL(program, readT<TAG_t>(p));
+        Value *args[] = { arg_runtime, getPtr(tableName) };
+        Value *found = callC((void *)jit_sexists, ctx->i32Ty, args);
+        failIf(builder.CreateICmpEQ(found, getInt32(0)));
+        break;
+    }
+    CASE_(SMatch)
+    CASE_(SIs)
+    CASE_(SIsa) {
+        tag_t *tableName = TBL_GET_IMPL(program, readT<TAG_t>(p));
+        Value *result;
+        if (opcode == SMatch) {
+            Value *args[] = { arg_runtime, getPtr(tableName), getCur() };
+            result = callC((void *)jit_smatch, ctx->i64Ty, args);
+        }
+        else {
+            Value *start = toPos(pop());
+            Value *args[] = { arg_runtime, getPtr(tableName), start, getCur() };
+            result = callC(opcode == SIs ? (void *)jit_sis : (void *)jit_sisa,
+                    ctx->i64Ty, args);
+        }
+        failIf(builder.CreateICmpSLT(result, getInt(0)));
+        consume(result);
+        break;
+    }
+    CASE_(Label) {
+        break;
+    }
+    default:
+        /* Exit (and anything we do not know) leaves the nterm */
+        return false;
 #undef CASE_
+    }
+    return true;
+}
+
+static MOZVM_THREAD_LOCAL const char *jit_stack_limit = NULL;
+
+const char *mozvm_jit_stack_limit(void)
+{
+    if (jit_stack_limit == NULL) {
+#ifdef __GLIBC__
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                jit_stack_limit = (const char *)addr + MOZ_JIT_STACK_MARGIN;
+            }
+            pthread_attr_destroy(&attr);
         }
-        p += shift;
+#endif
+        if (jit_stack_limit == NULL) {
+            /* let compiled code use the margin below the first parse */
+            jit_stack_limit = (const char *)__builtin_frame_address(0) - MOZ_JIT_STACK_MARGIN;
+        }
+    }
+    return jit_stack_limit;
+}
+
+static inline JitContext *get_context(moz_program_t *p)
+{
+    return reinterpret_cast<JitContext *>(p->jit_context);
+}
+
+static void set_state(JitContext *ctx, mozvm_nterm_entry_t *e, unsigned state)
+{
+    std::lock_guard<std::mutex> guard(ctx->lock);
+    e->state = state;
+}
+
+static moz_jit_func_t jit_compile(JitContext *ctx, moz_program_t *program, mozvm_nterm_entry_t *e)
+{
+    unsigned nterm = e - program->nterm_entry;
+    std::map<unsigned, Function *>::const_iterator itr;
+    std::lock_guard<std::mutex> compiling(ctx->compiling);
+
+    if (e->compiled_code) {
+        return e->compiled_code;
+    }
+    if (e->state == MOZVM_JIT_STATE_FAILED) {
+        return NULL;
+    }
+    if (ctx->EE == NULL && !ctx->createEngine()) {
+        set_state(ctx, e, MOZVM_JIT_STATE_FAILED);
+        return NULL;
     }
 
-    //builder.CreateRet(builder.getInt8(0));
-    M->dump();
-    if(verifyFunction(*F)) {
-        F->eraseFromParent();
+    JitCompiler compiler(ctx, program);
+    if (!compiler.compile(nterm)) {
+        const std::map<unsigned, Function *> &funcs = compiler.compiled();
+        for (itr = funcs.begin(); itr != funcs.end(); ++itr) {
+            set_state(ctx, program->nterm_entry + itr->first, MOZVM_JIT_STATE_FAILED);
+        }
         return NULL;
     }
-    _ctx->EE->finalizeObject();
-    e->compiled_code = (moz_jit_func_t) _ctx->EE->getPointerToFunction(F);
+    compiler.optimize();
+#ifdef MOZVM_JIT_DUMP
+    compiler.module()->print(errs(), NULL);
+#endif
+
+    std::vector<std::pair<unsigned, std::string> > names;
+    const std::map<unsigned, Function *> &funcs = compiler.compiled();
+    for (itr = funcs.begin(); itr != funcs.end(); ++itr) {
+        names.push_back(std::make_pair(itr->first, itr->second->getName().str()));
+    }
+    ctx->EE->addModule(std::move(compiler.module()));
+    for (size_t i = 0; i < names.size(); i++) {
+        uint64_t addr = ctx->EE->getFunctionAddress(names[i].second);
+        mozvm_nterm_entry_t *entry = program->nterm_entry + names[i].first;
+        if (addr == 0) {
+            set_state(ctx, entry, MOZVM_JIT_STATE_FAILED);
+            continue;
+        }
+        /* interpreter may be running; publish code after it is finalized */
+        __atomic_store_n(&entry->compiled_code, (moz_jit_func_t)addr, __ATOMIC_RELEASE);
+        set_state(ctx, entry, MOZVM_JIT_STATE_COMPILED);
+    }
     return e->compiled_code;
 }
 
-#ifdef __cplusplus
+#ifdef MOZVM_JIT_USE_BACKGROUND_COMPILE
+static void jit_worker(JitContext *ctx, moz_program_t *program)
+{
+    std::unique_lock<std::mutex> guard(ctx->lock);
+    while (true) {
+        while (!ctx->stop && ctx->queue.empty()) {
+            ctx->cond.wait(guard);
+        }
+        if (ctx->stop) {
+            break;
+        }
+        mozvm_nterm_entry_t *e = ctx->queue.front();
+        ctx->queue.pop_front();
+        guard.unlock();
+        jit_compile(ctx, program, e);
+        guard.lock();
+    }
+}
+#endif
+
+void mozvm_jit_init(moz_program_t *program)
+{
+    JitContext *ctx = new JitContext();
+    program->jit_context = reinterpret_cast<void *>(ctx);
 }
+
+void mozvm_jit_dispose(moz_program_t *program)
+{
+    unsigned i;
+    JitContext *ctx = get_context(program);
+#ifdef MOZVM_JIT_USE_BACKGROUND_COMPILE
+    {
+        std::lock_guard<std::mutex> guard(ctx->lock);
+        ctx->stop = true;
+        ctx->cond.notify_one();
+    }
+    if (ctx->worker.joinable()) {
+        ctx->worker.join();
+    }
 #endif
+    for (i = 0; i < program->C.nterm_size; i++) {
+        program->nterm_entry[i].compiled_code = NULL;
+    }
+    delete ctx;
+    program->jit_context = NULL;
+}
+
+void mozvm_jit_request(moz_runtime_t *runtime, mozvm_nterm_entry_t *e)
+{
+    moz_program_t *program = runtime->program;
+    JitContext *ctx = get_context(program);
+    {
+        std::lock_guard<std::mutex> guard(ctx->lock);
+        if (e->state != MOZVM_JIT_STATE_NONE) {
+            return;
+        }
+        e->state = MOZVM_JIT_STATE_QUEUED;
+#ifdef MOZVM_JIT_USE_BACKGROUND_COMPILE
+        if (!ctx->worker.joinable()) {
+            ctx->worker = std::thread(jit_worker, ctx, program);
+        }
+        ctx->queue.push_back(e);
+        ctx->cond.notify_one();
+        return;
+#endif
+    }
+    jit_compile(ctx, program, e);
+}
+
+moz_jit_func_t mozvm_jit_compile(moz_runtime_t *runtime, mozvm_nterm_entry_t *e)
+{
+    return jit_compile(get_context(runtime->program), runtime->program, e);
+}
+
 #endif /*MOZVM_ENABLE_JIT*/
@@ -8,10 +8,26 @@ extern "C" {
 #endif
 
 #ifdef MOZVM_ENABLE_JIT
-void mozvm_jit_init(moz_runtime_t *runtime);
-void mozvm_jit_reset(moz_runtime_t *runtime);
-void mozvm_jit_dispose(moz_runtime_t *runtime);
+/* returned by compiled code instead of a position when the stack runs out */
+#define MOZVM_JIT_STACK_OVERFLOW ((const char *)1)
+
+/* the compiler belongs to the program, so that its runtimes share code */
+void mozvm_jit_init(moz_program_t *program);
+void mozvm_jit_dispose(moz_program_t *program);
 moz_jit_func_t mozvm_jit_compile(moz_runtime_t *runtime, mozvm_nterm_entry_t *e);
+void mozvm_jit_request(moz_runtime_t *runtime, mozvm_nterm_entry_t *e);
+/* the lowest C stack address compiled code may use on this thread */
+const char *mozvm_jit_stack_limit(void);
+/* AST_MODE_EVENT: the flush TCommit does every MOZ_AST_FLUSH_INTERVAL logs
+ * (vm.c); compiled frames keep the bytecode address they resume at in
+ * FP_NEXT so that it can tell them apart */
+void moz_runtime_flush_events(moz_runtime_t *runtime, long *fp);
+
+/* compiled_code is published by the compiler thread */
+static inline moz_jit_func_t mozvm_jit_get_code(mozvm_nterm_entry_t *e)
+{
+    return __atomic_load_n(&e->compiled_code, __ATOMIC_ACQUIRE);
+}
 #endif
 
 #ifdef __cplusplus
@@ -4,6 +4,12 @@
 #include <limits.h>
 
 #include "mozvm_config.h"
+#ifdef MOZVM_USE_MMAP_INPUT
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 // #define VERBOSE_DEBUG 1
 // #define LOADER_DEBUG 2
 
@@ -40,10 +46,6 @@ extern "C" {
 
 // #define LOADER_DEBUG 1
 
-#ifdef MOZVM_USE_DIRECT_THREADING
-#error FIXME. Need to implement First, TblJump1, TblJump2, TblJump3
-#endif
-
 #ifdef LOADER_DEBUG
 static void mozvm_loader_dump(mozvm_loader_t *L, int print);
 static void dump_set(bitset_t *set, char *buf);
@@ -69,6 +71,52 @@ static char *load_file(const char *path, size_t *size, int align)
     (void)readed;
 }
 
+#ifdef MOZVM_USE_MMAP_INPUT
+/*
+ * Map the input read-only instead of copying it. We first reserve the
+ * file size rounded up to a page plus one spare page of anonymous zero
+ * memory, then map the file over the front of it. The kernel zero-fills
+ * the tail of the last file page, and the spare page covers files whose
+ * size is a multiple of the page size, so at least one page of NUL bytes
+ * always follows the input (the sentinel load_file() gets from calloc).
+ * Returns NULL for empty or irregular files; the caller then falls back
+ * to load_file().
+ */
+static char *map_file(const char *path, size_t *size, size_t *mapped)
+{
+    struct stat st;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len, reserve;
+    char *base, *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    len = (size_t)st.st_size;
+    reserve = (len + page - 1) / page * page + page;
+    base = (char *)mmap(NULL, reserve, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    data = (char *)mmap(base, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        munmap(base, reserve);
+        return NULL;
+    }
+    *size = len;
+    *mapped = reserve;
+    return data;
+}
+#endif
+
 typedef struct input_stream {
     size_t pos;
     size_t end;
@@ -128,8 +176,12 @@ mozvm_loader_t *mozvm_loader_init(mozvm_loader_t *L, unsigned inst_size)
     L->jmptbl1_id = 0;
     L->jmptbl2_id = 0;
     L->jmptbl3_id = 0;
+#endif
+#ifdef MOZVM_USE_NTERM
+    L->nterm_id = 0;
 #endif
     L->table = (unsigned *) VM_MALLOC(sizeof(unsigned) * inst_size);
+    L->program = NULL;
     ARRAY_init(uint8_t, &L->buf, 4);
     return L;
 }
@@ -137,28 +189,61 @@ mozvm_loader_t *mozvm_loader_init(mozvm_loader_t *L, unsigned inst_size)
 moz_inst_t *mozvm_loader_freeze(mozvm_loader_t *L)
 {
     moz_inst_t *inst = ARRAY_n(L->buf, 0);
+    unsigned i;
+    for (i = 0; i < L->R->C.nterm_size; i++) {
+        uintptr_t index = (uintptr_t) L->R->C.nterm_code[i];
+        L->R->C.nterm_code[i] = inst + L->table[index];
+    }
+#ifndef MOZVM_PROFILE_INST
+    /* kept for mozvm_loader_write_profile() otherwise */
     VM_FREE(L->table);
     L->table = NULL;
+#endif
 #ifdef MOZVM_ENABLE_JIT
-    {
-        unsigned i;
-        for (i = 0; i < L->R->C.nterm_size; i++) {
-            uintptr_t begin = (uintptr_t) L->R->nterm_entry[i].begin;
-            uintptr_t end   = (uintptr_t) L->R->nterm_entry[i].end;
-            L->R->nterm_entry[i].begin = inst + begin;
-            L->R->nterm_entry[i].end   = inst + end;
-        }
+    for (i = 0; i < L->R->C.nterm_size; i++) {
+        uintptr_t begin = (uintptr_t) L->R->nterm_entry[i].begin;
+        uintptr_t end   = (uintptr_t) L->R->nterm_entry[i].end;
+        L->R->nterm_entry[i].begin = inst + begin;
+        L->R->nterm_entry[i].end   = inst + end;
     }
 #endif
+    L->program = moz_program_init(L->R, inst, L->buf.list);
     return inst;
 }
 
 void mozvm_loader_dispose(mozvm_loader_t *L)
 {
-    ARRAY_dispose(uint8_t, &L->buf);
+    if (L->program) {
+        moz_program_release(L->program);
+    }
+    else {
+        ARRAY_dispose(uint8_t, &L->buf);
+    }
+    if (L->table) {
+        VM_FREE(L->table);
+    }
+    if (L->profile_inst) {
+        VM_FREE(L->profile_inst);
+    }
+    if (L->profile_memo_unused) {
+        VM_FREE(L->profile_memo_unused);
+    }
+    mozvm_loader_unload_input(L);
+}
+
+void mozvm_loader_unload_input(mozvm_loader_t *L)
+{
     if (L->input) {
+#ifdef MOZVM_USE_MMAP_INPUT
+        if (L->input_mapped) {
+            munmap(L->input, L->input_mapped);
+        }
+        else
+#endif
         VM_FREE(L->input);
     }
+    L->input = NULL;
+    L->input_size = 0;
 }
 
 void moz_loader_print_stats(mozvm_loader_t *L)
@@ -281,12 +366,60 @@ static int *alloc_jump_table(moz_runtime_t *r, uint16_t tblId)
     return r->C.jumps + MOZ_JMPTABLE_SIZE * tblId;
 }
 
+/*
+ * A memo point the training run looked up but never hit only costs time:
+ * Lookup/TLookup go away, Memo/TMemo become the Succ that pops the Alt
+ * frame and MemoFail becomes a plain Fail.
+ */
+static int mozvm_loader_drop_memo(mozvm_loader_t *L, input_stream_t *is, uint8_t opcode)
+{
+    size_t pos = is->pos;
+    uint32_t memoId;
+    switch (opcode) {
+    case Lookup:
+    case Memo:
+    case MemoFail:
+    case TLookup:
+    case TMemo:
+        break;
+    default:
+        return 0;
+    }
+    read8(is);
+    memoId = read32(is);
+    is->pos = pos;
+    if (memoId >= L->profile_memo_size || !L->profile_memo_unused[memoId]) {
+        return 0;
+    }
+    switch (opcode) {
+    case Lookup:
+        skip(is, 1 + 4 + 3);
+        break;
+    case TLookup:
+        skip(is, 1 + 4 + 3 + 2);
+        break;
+    case Memo:
+    case TMemo:
+        skip(is, 1 + 4);
+        mozvm_loader_write_opcode(L, Succ);
+        break;
+    case MemoFail:
+        skip(is, 1 + 4);
+        mozvm_loader_write_opcode(L, Fail);
+        break;
+    }
+    return 1;
+}
+
 static void mozvm_loader_load_inst(mozvm_loader_t *L, input_stream_t *is)
 {
     uint8_t opcode = read8(is);
     int has_jump = opcode & 0x80;
     opcode = opcode & 0x7f;
 #define CASE_(OP) case OP:
+    if (L->profile_memo_unused && mozvm_loader_drop_memo(L, is, opcode)) {
+        opcode = Nop;
+    }
     if (opcode == Nop
 #ifdef MOZVM_USE_JMPTBL
             || opcode == First
@@ -348,6 +481,9 @@ static void mozvm_loader_load_inst(mozvm_loader_t *L, input_stream_t *is)
         else {
             mozvm_loader_write_opcode(L, Skip);
         }
+#endif
+#ifdef MOZVM_USE_NTERM
+        mozvm_loader_write16(L, L->nterm_id);
 #endif
         break;
     }
@@ -575,6 +711,9 @@ static void mozvm_loader_load_inst(mozvm_loader_t *L, input_stream_t *is)
     }
     CASE_(Label) {
         uint16_t label = read16(is);
+#ifdef MOZVM_USE_NTERM
+        L->nterm_id = label;
+#endif
 #ifdef MOZVM_EMIT_OP_LABEL
         mozvm_loader_write16(L, label);
 #endif
@@ -608,9 +747,234 @@ static void set_opcode(mozvm_loader_t *L, unsigned idx, long opcode)
 #endif
 }
 
+#ifdef MOZVM_USE_TAILCALL
+/* Call whose next instruction is Ret does not need its own return slot */
+static void mozvm_loader_tailcall(mozvm_loader_t *L)
+{
+    unsigned j = 0, len = ARRAY_size(L->buf);
+    while (j < len) {
+        uint8_t opcode = get_opcode(L, j);
+        unsigned shift = opcode_size(opcode);
+        if (opcode == Call) {
+            uint8_t *p = L->buf.list + j + shift - 2 * sizeof(mozaddr_t);
+            if (get_opcode(L, j + shift + *(mozaddr_t *)p) == Ret) {
+                set_opcode(L, j, TailCall);
+            }
+        }
+        j += shift;
+    }
+}
+#endif
+
+#ifdef MOZVM_USE_SUPERINST
+/*
+ * Fuse frequent instruction sequences (see the opcode pairs printed by
+ * PRINT_INST == 3) into superinstructions. Only the opcode of the first
+ * instruction is rewritten, so jumps into the middle of a sequence still
+ * land on the original instructions.
+ */
+static int mozvm_loader_fuse_at(mozvm_loader_t *L, unsigned idx, unsigned len)
+{
+    uint8_t op0 = get_opcode(L, idx);
+    unsigned next1 = idx + opcode_size(op0);
+    uint8_t op1 = next1 < len ? get_opcode(L, next1) : Nop;
+    unsigned next2 = next1 + opcode_size(op1);
+    uint8_t op2 = next2 < len ? get_opcode(L, next2) : Nop;
+
+    switch (op0) {
+    case Alt:
+        if (op1 == Byte && op2 == Succ) {
+            return AltByteSucc;
+        }
+        break;
+    case Byte:
+        if (op1 == RSet) {
+            return ByteRSet;
+        }
+        if (op1 == Byte) {
+            return Byte2;
+        }
+        break;
+    case Str:
+        if (op1 == Str) {
+            return Str2;
+        }
+        break;
+    case TTag:
+        if (op1 == TCapture) {
+            return TTagCapture;
+        }
+        break;
+    default:
+        break;
+    }
+    return op0;
+}
+
+static void mozvm_loader_fuse(mozvm_loader_t *L)
+{
+    unsigned j = 0, len = ARRAY_size(L->buf);
+    while (j < len) {
+        uint8_t opcode = get_opcode(L, j);
+        int fused = mozvm_loader_fuse_at(L, j, len);
+        if (fused != opcode) {
+            set_opcode(L, j, fused);
+        }
+        j += opcode_size(opcode);
+    }
+}
+#endif
+
+/*
+ * Classify the fail target of every Alt for the event flush in vm.c. A
+ * repetition is compiled to
+ *   Alt L; loop: ...; Jump loop; L: Succ
+ * whose frame is only popped by failing into it; the Succ then pops the
+ * frame below as well. Targets shared by Alts of different kinds are left
+ * MOZVM_FAIL_RESUME.
+ */
+#define FAIL_KIND_UNSET 0xff
+static void mozvm_loader_fail_kind(mozvm_loader_t *L)
+{
+    unsigned j = 0, len = ARRAY_size(L->buf);
+    unsigned jump_size = opcode_size(Jump);
+    uint8_t *kinds = (uint8_t *)VM_MALLOC(len);
+    int16_t *ops = (int16_t *)VM_MALLOC(sizeof(int16_t) * len);
+
+    memset(kinds, FAIL_KIND_UNSET, len);
+    for (j = 0; j < len; j++) {
+        ops[j] = -1;
+    }
+    for (j = 0; j < len; j += opcode_size(get_opcode(L, j))) {
+        ops[j] = get_opcode(L, j);
+    }
+    for (j = 0; j < len; j += opcode_size(ops[j])) {
+        unsigned next = j + opcode_size(ops[j]);
+        unsigned target;
+        uint8_t kind = MOZVM_FAIL_RESUME;
+        if (opcode_base(ops[j]) != Alt) {
+            continue;
+        }
+        target = next + *(mozaddr_t *)(L->buf.list + next - sizeof(mozaddr_t));
+        if (target >= len || ops[target] < 0) {
+            continue;
+        }
+        switch (ops[target]) {
+        case MemoFail:
+        case Fail:
+            kind = MOZVM_FAIL_RETHROW;
+            break;
+        case Succ:
+            if (ops[j] == Alt && target >= jump_size &&
+                    ops[target - jump_size] == Jump &&
+                    target + *(mozaddr_t *)(L->buf.list + target - sizeof(mozaddr_t)) == next) {
+                kind = MOZVM_FAIL_COMMIT;
+            }
+            break;
+        }
+        if (kinds[target] == FAIL_KIND_UNSET) {
+            kinds[target] = kind;
+        }
+        else if (kinds[target] != kind) {
+            kinds[target] = MOZVM_FAIL_RESUME;
+        }
+    }
+    for (j = 0; j < len; j++) {
+        if (kinds[j] == FAIL_KIND_UNSET) {
+            kinds[j] = MOZVM_FAIL_RESUME;
+        }
+    }
+    VM_FREE(ops);
+    L->R->C.fail_kind = kinds;
+}
+#undef FAIL_KIND_UNSET
+
+static unsigned long mozvm_loader_profile_count(mozvm_loader_t *L, unsigned id)
+{
+    return id < L->profile_inst_size ? L->profile_inst[id] : 0;
+}
+
+/*
+ * Lay nonterminals out hottest first, so that the code a training run
+ * spent its time in shares cache lines and pages. chunks[k] is the first
+ * instruction of the k-th nonterminal; the first chunk holds the start
+ * rule and stays in front because parsing enters right after the Exit
+ * pair. Jumps still hold bytecode indices here, so moving a chunk only
+ * means moving its bytes and shifting L->table.
+ */
+static void mozvm_loader_layout(mozvm_loader_t *L, unsigned *chunks, unsigned nchunk)
+{
+    unsigned i, k, *order, *begin, *end;
+    unsigned long *heat;
+    ARRAY(uint8_t) buf;
+
+    if (nchunk < 2) {
+        return;
+    }
+    order = (unsigned *)VM_MALLOC(sizeof(unsigned) * nchunk);
+    begin = (unsigned *)VM_MALLOC(sizeof(unsigned) * nchunk);
+    end   = (unsigned *)VM_MALLOC(sizeof(unsigned) * nchunk);
+    heat  = (unsigned long *)VM_MALLOC(sizeof(unsigned long) * nchunk);
+    for (k = 0; k < nchunk; k++) {
+        unsigned last = k + 1 < nchunk ? chunks[k + 1] : L->inst_size;
+        unsigned j, op = Nop;
+        begin[k] = L->table[chunks[k]];
+        end[k] = k + 1 < nchunk ? L->table[chunks[k + 1]] : ARRAY_size(L->buf);
+        heat[k] = 0;
+        for (i = chunks[k]; i < last; i++) {
+            heat[k] += mozvm_loader_profile_count(L, i);
+        }
+        /* control must not fall through into the next chunk */
+        for (j = begin[k]; j < end[k]; j += opcode_size(op)) {
+            op = get_opcode(L, j);
+        }
+        if (op != Ret && op != Jump && op != Fail && op != Exit) {
+            goto L_done;
+        }
+    }
+    /* stable insertion sort by heat; chunk 0 stays first */
+    for (k = 0; k < nchunk; k++) {
+        unsigned n = k;
+        while (n > 1 && heat[order[n - 1]] < heat[k]) {
+            order[n] = order[n - 1];
+            n--;
+        }
+        order[n] = k;
+    }
+    ARRAY_init(uint8_t, &buf, ARRAY_size(L->buf));
+    memcpy(buf.list, L->buf.list, begin[0]);
+    ARRAY_size(buf) = begin[0];
+    for (k = 0; k < nchunk; k++) {
+        unsigned c = order[k];
+        unsigned last = c + 1 < nchunk ? chunks[c + 1] : L->inst_size;
+        int delta = (int)ARRAY_size(buf) - (int)begin[c];
+        memcpy(buf.list + ARRAY_size(buf), L->buf.list + begin[c], end[c] - begin[c]);
+        ARRAY_size(buf) += end[c] - begin[c];
+        for (i = chunks[c]; i < last; i++) {
+            L->table[i] += delta;
+        }
+#ifdef MOZVM_ENABLE_JIT
+        {
+            mozvm_nterm_entry_t *e = L->R->nterm_entry + c;
+            e->begin = (moz_inst_t *)((long)e->begin + delta);
+            e->end   = (moz_inst_t *)((long)e->end + delta);
+        }
+#endif
+    }
+    ARRAY_dispose(uint8_t, &L->buf);
+    L->buf = buf;
+L_done:
+    VM_FREE(order);
+    VM_FREE(begin);
+    VM_FREE(end);
+    VM_FREE(heat);
+}
+
 static void mozvm_loader_load(mozvm_loader_t *L, input_stream_t *is)
 {
     int i = 0, j = 0;
+    unsigned nchunk = 0;
+    unsigned *chunks = (unsigned *)VM_MALLOC(sizeof(unsigned) * (L->R->C.nterm_size + 1));
 #ifdef MOZVM_ENABLE_JIT
     int nterm = 0;
 #endif
@@ -622,6 +986,14 @@ static void mozvm_loader_load(mozvm_loader_t *L, input_stream_t *is)
     mozvm_loader_write_opcode(L, Exit); // exit fail
     mozvm_loader_write8(L, 1);
     while (is->pos < is->end) {
+        if ((*peek(is) & 0x7f) == Label && nchunk <= L->R->C.nterm_size) {
+            if (nchunk < L->R->C.nterm_size) {
+                /* an instruction index until mozvm_loader_freeze() */
+                L->R->C.nterm_code[nchunk] = (moz_inst_t *)(uintptr_t)i;
+            }
+            chunks[nchunk] = nchunk == 0 ? 0 : i;
+            nchunk++;
+        }
 #ifdef MOZVM_ENABLE_JIT
         uint8_t opcode = *peek(is);
         if (opcode == Label) {
@@ -637,10 +1009,16 @@ static void mozvm_loader_load(mozvm_loader_t *L, input_stream_t *is)
     for (i = 0; i < nterm - 1; i++) {
         mozvm_nterm_entry_t *e1 = L->R->nterm_entry + i;
         mozvm_nterm_entry_t *e2 = L->R->nterm_entry + i + 1;
-        e1->end = e2->begin - 1;
+        e1->end = e2->begin;
+    }
+    if (nterm > 0) {
+        L->R->nterm_entry[nterm - 1].end = (moz_inst_t *)(long)ARRAY_size(L->buf);
     }
-    L->R->nterm_entry[nterm - 1].end = (moz_inst_t *)(long)ARRAY_size(L->buf);
 #endif
+    if (L->profile_inst) {
+        mozvm_loader_layout(L, chunks, nchunk);
+    }
+    VM_FREE(chunks);
 
     // fprintf(stderr, "\n");
 
@@ -691,22 +1069,21 @@ static void mozvm_loader_load(mozvm_loader_t *L, input_stream_t *is)
             }
             break;
         case TblJump1:
-            tblId = *(L->buf.list + j + shift - sizeof(uint16_t));
+            tblId = *(uint16_t *)(L->buf.list + j + shift - sizeof(uint16_t));
             t1 = L->R->C.jumps1 + tblId;
-            t1->jumps[0] = L->table[t1->jumps[0]] - (j + shift);
             for (i = 0; i < 2; i++) {
                 t1->jumps[i] = L->table[t1->jumps[i]] - (j + shift);
             }
             break;
         case TblJump2:
-            tblId = *(L->buf.list + j + shift - sizeof(uint16_t));
+            tblId = *(uint16_t *)(L->buf.list + j + shift - sizeof(uint16_t));
             t2 = L->R->C.jumps2 + tblId;
             for (i = 0; i < 4; i++) {
                 t2->jumps[i] = L->table[t2->jumps[i]] - (j + shift);
             }
             break;
         case TblJump3:
-            tblId = *(L->buf.list + j + shift - sizeof(uint16_t));
+            tblId = *(uint16_t *)(L->buf.list + j + shift - sizeof(uint16_t));
             t3 = L->R->C.jumps3 + tblId;
             for (i = 0; i < 8; i++) {
                 t3->jumps[i] = L->table[t3->jumps[i]] - (j + shift);
@@ -718,6 +1095,13 @@ static void mozvm_loader_load(mozvm_loader_t *L, input_stream_t *is)
 #undef GET_JUMP_ADDR
         j += shift;
     }
+#ifdef MOZVM_USE_TAILCALL
+    mozvm_loader_tailcall(L);
+#endif
+#ifdef MOZVM_USE_SUPERINST
+    mozvm_loader_fuse(L);
+#endif
+    mozvm_loader_fail_kind(L);
 
 #ifdef LOADER_DEBUG
     mozvm_loader_dump(L, LOADER_DEBUG > 1);
@@ -725,8 +1109,8 @@ static void mozvm_loader_load(mozvm_loader_t *L, input_stream_t *is)
 
 #ifdef MOZVM_USE_DIRECT_THREADING
     j = 0;
-    while (j < ARRAY_size(L->buf)) {
-        uint8_t opcode = get_opcode(L, j);;
+    while (j < (int)ARRAY_size(L->buf)) {
+        uint8_t opcode = get_opcode(L, j);
         unsigned shift = opcode_size(opcode);
         set_opcode(L, j, addr[opcode]);
         j += shift;
@@ -734,6 +1118,75 @@ static void mozvm_loader_load(mozvm_loader_t *L, input_stream_t *is)
 #endif
 }
 
+static void *mozvm_loader_profile_grow(void *p, unsigned *size, unsigned id, size_t elm)
+{
+    if (id >= *size) {
+        unsigned n = id + 1;
+        p = VM_REALLOC(p, elm * n);
+        memset((char *)p + elm * *size, 0, elm * (n - *size));
+        *size = n;
+    }
+    return p;
+}
+
+/*
+ * Reads the profile written by mozvm_loader_write_profile(). Lines are
+ *   inst <bytecode index> <count>
+ *   memo <id> <lookup> <hit> <fail_hit> <skipped> <state>
+ * and anything else is ignored.
+ */
+int mozvm_loader_load_profile(mozvm_loader_t *L, const char *file)
+{
+    char line[256];
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned id;
+        unsigned long count, lookup, hit, fail_hit, skipped;
+        if (sscanf(line, "inst %u %lu", &id, &count) == 2) {
+            L->profile_inst = (unsigned long *)mozvm_loader_profile_grow(
+                    L->profile_inst, &L->profile_inst_size, id, sizeof(unsigned long));
+            L->profile_inst[id] = count;
+        }
+        else if (sscanf(line, "memo %u %lu %lu %lu %lu", &id, &lookup, &hit, &fail_hit, &skipped) == 5) {
+            L->profile_memo_unused = (uint8_t *)mozvm_loader_profile_grow(
+                    L->profile_memo_unused, &L->profile_memo_size, id, sizeof(uint8_t));
+            L->profile_memo_unused[id] = lookup > 0 && hit == 0 && fail_hit == 0;
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+#ifdef MOZVM_PROFILE_INST
+void mozvm_loader_write_profile(mozvm_loader_t *L, FILE *fp)
+{
+    /* counts are indexed by bytecode offset; skip the Exit pair */
+    unsigned entry = 2 * (MOZVM_INST_HEADER_SIZE + 1);
+    unsigned i;
+    fprintf(fp, "# inst id count\n");
+    for (i = 0; i < L->inst_size; i++) {
+        unsigned pos = L->table[i];
+        long count;
+        if (pos < entry || pos >= ARRAY_size(L->buf)) {
+            continue;
+        }
+        /* Label, Nop and First are not emitted and share the next offset */
+        if (i + 1 < L->inst_size && L->table[i + 1] == pos) {
+            continue;
+        }
+        if ((count = L->R->C.profile[pos]) != 0) {
+            fprintf(fp, "inst %u %ld\n", i, count);
+        }
+    }
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+    moz_runtime_print_memo_points(L->R, fp);
+#endif
+}
+#endif
+
 static int checkFileType(input_stream_t *is)
 {
     return read8(is) == 'N' && read8(is) == 'E' && read8(is) == 'Z';
@@ -747,6 +1200,12 @@ static int checkVersion(input_stream_t *is)
 
 int mozvm_loader_load_input(mozvm_loader_t *L, const char *file)
 {
+#ifdef MOZVM_USE_MMAP_INPUT
+    L->input_mapped = 0;
+    if ((L->input = map_file(file, &L->input_size, &L->input_mapped)) != NULL) {
+        return 1;
+    }
+#endif
     L->input = load_file(file, &L->input_size, 32);
     return L->input != NULL;
 }
@@ -775,7 +1234,7 @@ moz_inst_t *mozvm_loader_load_file(mozvm_loader_t *L, const char *file)
     nterm_size  = (unsigned) read16(&is);
 
     mozvm_loader_init(L, inst_size);
-    L->R = moz_runtime_init(memo_size, nterm_size);
+    L->R = moz_runtime_init(memo_size, nterm_size, L->memo_type);
 
 #if defined(MOZVM_PROFILE) && defined(MOZVM_MEMORY_PROFILE)
     mozvm_mm_snapshot(MOZVM_MM_PROF_EVENT_RUNTIME_INIT);
@@ -789,6 +1248,7 @@ moz_inst_t *mozvm_loader_load_file(mozvm_loader_t *L, const char *file)
 
     if (bc->nterm_size > 0) {
         bc->nterms = (const char **)VM_MALLOC(sizeof(const char *) * bc->nterm_size);
+        bc->nterm_code = (moz_inst_t **)VM_CALLOC(bc->nterm_size, sizeof(moz_inst_t *));
         for (i = 0; i < bc->nterm_size; i++) {
             uint16_t len = read16(&is);
             char *str = peek(&is);
@@ -985,7 +1445,7 @@ static void mozvm_loader_dump(mozvm_loader_t *L, int print)
     int i = 0, j = 0;
     while (j < (int)ARRAY_size(L->buf)) {
         uint8_t *p = L->buf.list + j;
-        uint8_t opcode = *p;
+        uint8_t opcode = opcode_base(*p);
         unsigned shift = opcode_size(opcode);
 #ifdef MOZVM_PROFILE_INST
         if (L->R->C.profile) {
@@ -993,7 +1453,7 @@ static void mozvm_loader_dump(mozvm_loader_t *L, int print)
         }
 #endif
 
-        OP_PRINT("%ld, %04d, %s ", (long)p, i, opcode2str(opcode));
+        OP_PRINT("%ld, %04d, %s ", (long)p, i, opcode2str(*p));
         switch (opcode) {
 #define CASE_(OP) case OP:
         CASE_(Nop);
@@ -1017,8 +1477,13 @@ static void mozvm_loader_dump(mozvm_loader_t *L, int print)
         }
         CASE_(Ret);
         CASE_(Pos);
-        CASE_(Back);
+        CASE_(Back) {
+            break;
+        }
         CASE_(Skip) {
+#ifdef MOZVM_USE_NTERM
+            OP_PRINT("%d", *(int16_t *)(p + 1));
+#endif
             break;
         }
         CASE_(Byte);
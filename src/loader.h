@@ -14,6 +14,9 @@ DEF_ARRAY_T(uint8_t);
 struct mozvm_loader_t {
     char *input;
     size_t input_size;
+#ifdef MOZVM_USE_MMAP_INPUT
+    size_t input_mapped; /* length of the mapping, 0 if input was read */
+#endif
     unsigned inst_size;
     unsigned jmptbl_id;
 #ifdef MOZVM_USE_JMPTBL
@@ -22,8 +25,19 @@ struct mozvm_loader_t {
     unsigned jmptbl3_id;
 #endif
     moz_runtime_t *R;
+    /* shared by R and any runtime attached to it later; owns buf */
+    moz_program_t *program;
+    memo_type_t memo_type;
+#ifdef MOZVM_USE_NTERM
+    unsigned nterm_id;
+#endif
     unsigned *table;
     ARRAY(uint8_t) buf;
+    /* training profile read by mozvm_loader_load_profile() */
+    unsigned long *profile_inst;
+    unsigned profile_inst_size;
+    uint8_t *profile_memo_unused;
+    unsigned profile_memo_size;
 };
 
 typedef struct mozvm_loader_t mozvm_loader_t;
@@ -32,6 +46,13 @@ moz_inst_t *mozvm_loader_freeze(mozvm_loader_t *L);
 void mozvm_loader_dispose(mozvm_loader_t *L);
 moz_inst_t *mozvm_loader_load_file(mozvm_loader_t *L, const char *file);
 int mozvm_loader_load_input(mozvm_loader_t *L, const char *file);
+/* frees the input so that L can load the next one */
+void mozvm_loader_unload_input(mozvm_loader_t *L);
+/* must be called before mozvm_loader_load_file() */
+int mozvm_loader_load_profile(mozvm_loader_t *L, const char *file);
+#ifdef MOZVM_PROFILE_INST
+void mozvm_loader_write_profile(mozvm_loader_t *L, FILE *fp);
+#endif
 
 void moz_loader_print_stats(mozvm_loader_t *L);
 
@@ -1,14 +1,30 @@
 #include "mozvm.h"
 #include "loader.h"
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 static void usage(const char *arg)
 {
-    fprintf(stderr, "Usage: %s -p <bytecode_file> -i <input_file>\n", arg);
+    fprintf(stderr, "Usage: %s -p <bytecode_file> -i <input_file|->"
+            " [-m null|elastic|hash|assoc2|assoc4] [-M <memo_profile>]"
+            " [-P <profile_out>] [-O <profile_in>] [-r <delimiter>]\n"
+            " [-a tree|event|recognize] [-e <nterm>]"
+            " [-j <nterm> [-d <separator>] [-t <threads>]]\n"
+            " [-x <offset>:<removed>:<text>]... [-J]\n"
+            "       %s -p <bytecode_file> -b <file_list|directory> [-e <nterm>]"
+            " [-a tree|event|recognize] [-t <threads>] [-J]\n"
+            "  -i - parses one document after another from stdin, skipping the\n"
+            "  whitespace between them; the start rule (or -e <nterm>) must not\n"
+            "  anchor to the end of the input, and each document is buffered whole\n"
+            "  -J runs hot nonterminals compiled by the JIT (MOZVM_ENABLE_JIT)\n",
+            arg, arg);
 }
 
 static struct timeval g_timer;
@@ -28,6 +44,577 @@ static inline void _show_timer(const char *s, size_t bufsz)
     fprintf(stderr, "%f Mbps\n", ((double)bufsz)*8/sec/1000/1000);
 }
 
+/* -e: start the parse at nterm start, or at the start rule if start < 0 */
+static moz_inst_t *parse_init(moz_runtime_t *R, const char *str,
+        moz_inst_t *head, int start)
+{
+    if (start < 0) {
+        return moz_runtime_parse_init(R, str, head);
+    }
+    return moz_runtime_parse_init_nterm(R, str, head, start);
+}
+
+/* -a event: print one event a line, and the text of each leaf node */
+typedef struct event_frame_t {
+    const char *start;
+    unsigned nchild;
+} event_frame_t;
+
+DEF_ARRAY_T_OP(event_frame_t);
+
+typedef struct event_printer_t {
+    AstMachine *ast;
+    ARRAY(event_frame_t) frames; /* the open nodes, innermost last */
+} event_printer_t;
+
+static const char *event_text(event_printer_t *p, mozpos_t pos)
+{
+#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
+    (void)p;
+    return pos;
+#else
+    return p->ast->source + pos;
+#endif
+}
+
+/* indents a line for the current node and returns its frame */
+static event_frame_t *event_indent(event_printer_t *p)
+{
+    fprintf(stderr, "%*s", (ARRAY_size(p->frames) - 1) * 4, "");
+    return ARRAY_last(p->frames);
+}
+
+static void event_on_new(void *ctx, mozpos_t pos)
+{
+    event_printer_t *p = (event_printer_t *)ctx;
+    event_frame_t *f = event_indent(p);
+    fprintf(stderr, "new\n");
+    f->start = event_text(p, pos);
+    f->nchild = 0;
+}
+
+static void event_on_tag(void *ctx, const char *tag)
+{
+    event_indent((event_printer_t *)ctx);
+    fprintf(stderr, "#%s\n", tag);
+}
+
+static void event_on_capture(void *ctx, mozpos_t pos)
+{
+    event_printer_t *p = (event_printer_t *)ctx;
+    event_frame_t *f = event_indent(p);
+    const char *end = event_text(p, pos);
+    fprintf(stderr, "capture");
+    if (f->nchild == 0 && f->start && f->start <= end) {
+        fprintf(stderr, " '%.*s'", (int)(end - f->start), f->start);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void event_on_link(void *ctx)
+{
+    event_printer_t *p = (event_printer_t *)ctx;
+    event_frame_t f = { NULL, 0 };
+    event_indent(p);
+    fprintf(stderr, "link\n");
+    ARRAY_add(event_frame_t, &p->frames, &f);
+}
+
+static void event_on_pop(void *ctx, const char *label)
+{
+    event_printer_t *p = (event_printer_t *)ctx;
+    if (ARRAY_size(p->frames) > 1) {
+        ARRAY_size(p->frames) -= 1;
+    }
+    event_indent(p)->nchild++;
+    fprintf(stderr, "pop $%s\n", label ? label : "");
+}
+
+static void event_on_replace(void *ctx, const char *value)
+{
+    event_indent((event_printer_t *)ctx);
+    fprintf(stderr, "replace '%s'\n", value);
+}
+
+static void event_on_fold(void *ctx, mozpos_t pos)
+{
+    event_printer_t *p = (event_printer_t *)ctx;
+    event_frame_t *f = event_indent(p);
+    fprintf(stderr, "fold\n");
+    f->start = event_text(p, pos);
+    f->nchild = 1;
+}
+
+static void event_printer_init(event_printer_t *p, AstEvents *ev, AstMachine *ast)
+{
+    event_frame_t root = { NULL, 0 };
+    p->ast = ast;
+    ARRAY_init(event_frame_t, &p->frames, 16);
+    ARRAY_add(event_frame_t, &p->frames, &root);
+    ev->ctx = p;
+    ev->on_new = event_on_new;
+    ev->on_tag = event_on_tag;
+    ev->on_capture = event_on_capture;
+    ev->on_link = event_on_link;
+    ev->on_pop = event_on_pop;
+    ev->on_replace = event_on_replace;
+    ev->on_fold = event_on_fold;
+}
+
+/* -i -: parse one document after another from stdin, each with the start
+ * rule or nterm start; either must stop after a document instead of
+ * requiring the end of the input. whitespace between documents is skipped */
+static void parse_stream(moz_runtime_t *R, moz_inst_t *inst, int start,
+        unsigned quiet_mode, unsigned print_stats)
+{
+    moz_stream_t S;
+    Node *node = NULL;
+    long parsed;
+
+    moz_stream_init(&S, STDIN_FILENO);
+    S.start = start;
+    reset_timer();
+    while ((parsed = moz_runtime_parse_stream(R, &S, inst, &node)) == 0) {
+        if (node) {
+            if (!quiet_mode) {
+#ifdef NODE_USE_NODE_PRINT
+                Node_print(node);
+#endif
+            }
+            NODE_GC_RELEASE(node);
+        }
+    }
+    if (parsed == MOZVM_PARSE_STACK_OVERFLOW) {
+        fprintf(stderr, "parse error: stack overflow\n");
+    }
+    else if (parsed != MOZVM_PARSE_END_OF_STREAM) {
+        fprintf(stderr, "parse error at offset %lu\n",
+                (unsigned long)(S.offset + S.begin));
+    }
+    if (print_stats) {
+        _show_timer("stdin", S.offset + S.begin);
+    }
+    moz_stream_dispose(&S);
+}
+
+/* NUL bytes after a record (see load_file in loader.c) */
+#define RECORD_PADDING 32
+
+/* -r: parse each record of input on its own and return the number of
+ * records that failed. Records are copied out because the matching
+ * instructions need a NUL after the input, and the input may be mapped
+ * read-only. */
+static unsigned long parse_records(moz_runtime_t *R, moz_inst_t *inst, int start,
+        const char *input, size_t size, int delim, unsigned quiet_mode)
+{
+    const char *p = input, *end = input + size;
+    size_t capacity = 4096;
+    char *buf = (char *)VM_MALLOC(capacity);
+    unsigned long nrecord = 0, nerror = 0;
+
+    moz_runtime_set_source(R, input, end);
+    for (; p < end; p++, nrecord++) {
+        const char *q = (const char *)memchr(p, delim, end - p);
+        size_t len = (q ? q : end) - p;
+        Node *node;
+        long parsed;
+        if (len + RECORD_PADDING > capacity) {
+            while (len + RECORD_PADDING > capacity) {
+                capacity *= 2;
+            }
+            buf = (char *)VM_REALLOC(buf, capacity);
+        }
+        memcpy(buf, p, len);
+        memset(buf + len, 0, RECORD_PADDING);
+        p += len;
+        if (len == 0) {
+            continue;
+        }
+        moz_runtime_set_record(R, buf, buf + len);
+        parsed = moz_runtime_parse(R, buf, parse_init(R, buf, inst, start));
+        if (parsed != 0) {
+            fprintf(stderr, "parse error%s at record %lu\n",
+                    parsed == MOZVM_PARSE_STACK_OVERFLOW ? " (stack overflow)" : "",
+                    nrecord + 1);
+            nerror++;
+            continue;
+        }
+        node = ast_get_parsed_node(R->ast);
+        if (node) {
+            if (!quiet_mode) {
+#ifdef NODE_USE_NODE_PRINT
+                Node_print(node);
+#endif
+            }
+            NODE_GC_RELEASE(node);
+        }
+    }
+    VM_FREE(buf);
+    return nerror;
+}
+
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+static void print_parsed(moz_runtime_t *R, long parsed, unsigned quiet_mode)
+{
+    Node *node;
+    if (parsed != 0) {
+        fprintf(stderr, "parse error%s\n",
+                parsed == MOZVM_PARSE_STACK_OVERFLOW ? ": stack overflow" : "");
+    }
+    else if ((node = ast_get_parsed_node(R->ast)) != NULL) {
+        if (!quiet_mode) {
+#ifdef NODE_USE_NODE_PRINT
+            Node_print(node);
+#endif
+        }
+        NODE_GC_RELEASE(node);
+    }
+}
+
+/* -x: parse input, then make each edit to it in turn and parse it again */
+static void parse_edits(moz_runtime_t *R, moz_inst_t *head, const char *input,
+        size_t size, char **edits, unsigned nedit, unsigned quiet_mode,
+        unsigned print_stats)
+{
+    size_t capacity = size + RECORD_PADDING;
+    char *buf;
+    unsigned i;
+
+    for (i = 0; i < nedit; i++) {
+        capacity += strlen(edits[i]);
+    }
+    buf = (char *)VM_MALLOC(capacity);
+    memcpy(buf, input, size);
+    memset(buf + size, 0, RECORD_PADDING);
+    moz_runtime_incremental(R);
+
+    reset_timer();
+    moz_runtime_set_source(R, buf, buf + size);
+    print_parsed(R, moz_runtime_parse(R, buf, moz_runtime_parse_init(R, buf, head)), quiet_mode);
+    if (print_stats) {
+        _show_timer("parse", size);
+    }
+    for (i = 0; i < nedit; i++) {
+        char *p = edits[i], label[32];
+        size_t offset = strtoul(p, &p, 10), removed = 0, inserted;
+        if (*p == ':') {
+            removed = strtoul(p + 1, &p, 10);
+        }
+        if (*p++ != ':' || offset > size || removed > size - offset) {
+            fprintf(stderr, "error: bad edit '%s'\n", edits[i]);
+            exit(EXIT_FAILURE);
+        }
+        inserted = strlen(p);
+        memmove(buf + offset + inserted, buf + offset + removed, size - offset - removed);
+        memcpy(buf + offset, p, inserted);
+        size = size - removed + inserted;
+        memset(buf + size, 0, RECORD_PADDING);
+
+        reset_timer();
+        print_parsed(R, moz_runtime_reparse(R, buf, buf + size, head,
+                    offset, removed, inserted), quiet_mode);
+        if (print_stats) {
+            snprintf(label, sizeof(label), "edit %u", i + 1);
+            _show_timer(label, size);
+        }
+    }
+    VM_FREE(buf);
+}
+#endif
+
+static int parse_delimiter(const char *arg)
+{
+    if (arg[0] == '\\' && arg[1] != '\0') {
+        switch (arg[1]) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case '0': return '\0';
+        default:  return arg[1];
+        }
+    }
+    return arg[0];
+}
+
+/* -b: parse a list of files with a pool of threads sharing one program */
+typedef struct batch_file_t {
+    char *path;
+    size_t size;
+} batch_file_t;
+
+DEF_ARRAY_T_OP(batch_file_t);
+
+/*
+ * Files are dealt out by size up front, largest first, to the worker that
+ * has the fewest bytes so far. A worker takes its own files from the
+ * front, largest first; once it runs dry it steals from the back of the
+ * queue that has the most bytes left.
+ */
+typedef struct batch_queue_t {
+    pthread_mutex_t lock;
+    unsigned *files;
+    unsigned head;
+    unsigned tail;
+    size_t bytes; /* bytes left in files[head, tail) */
+} batch_queue_t;
+
+typedef struct batch_t {
+    ARRAY(batch_file_t) files;
+    batch_queue_t *queues;
+    unsigned nworker;
+    moz_program_t *program;
+    memo_type_t memo_type;
+    ast_mode_t ast_mode;
+    int start;
+    int jit;
+} batch_t;
+
+typedef struct batch_worker_t {
+    pthread_t thread;
+    batch_t *batch;
+    unsigned id;
+    unsigned long nfile;
+    unsigned long nerror;
+    size_t bytes;
+} batch_worker_t;
+
+static void batch_add_file(batch_t *B, const char *path, size_t size)
+{
+    batch_file_t f;
+    f.path = strdup(path);
+    f.size = size;
+    ARRAY_add(batch_file_t, &B->files, &f);
+}
+
+static void batch_add_path(batch_t *B, const char *path);
+
+static void batch_add_dir(batch_t *B, const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    if (d == NULL) {
+        fprintf(stderr, "error: failed to open directory '%s'\n", dir);
+        return;
+    }
+    while ((e = readdir(d)) != NULL) {
+        size_t len = strlen(dir) + strlen(e->d_name) + 2;
+        char *path;
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        path = (char *)VM_MALLOC(len);
+        snprintf(path, len, "%s/%s", dir, e->d_name);
+        batch_add_path(B, path);
+        VM_FREE(path);
+    }
+    closedir(d);
+}
+
+static void batch_add_path(batch_t *B, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "error: failed to stat '%s'\n", path);
+    }
+    else if (S_ISDIR(st.st_mode)) {
+        batch_add_dir(B, path);
+    }
+    else if (S_ISREG(st.st_mode)) {
+        batch_add_file(B, path, (size_t)st.st_size);
+    }
+}
+
+/* a directory is walked recursively, anything else lists one path a line */
+static void batch_add_list(batch_t *B, const char *list)
+{
+    struct stat st;
+    FILE *fp;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+
+    if (stat(list, &st) == 0 && S_ISDIR(st.st_mode)) {
+        batch_add_dir(B, list);
+        return;
+    }
+    if ((fp = fopen(list, "r")) == NULL) {
+        fprintf(stderr, "error: failed to open '%s'\n", list);
+        return;
+    }
+    while ((len = getline(&line, &capacity, fp)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            batch_add_path(B, line);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+static int batch_file_compare(const void *a, const void *b)
+{
+    const batch_file_t *f1 = (const batch_file_t *)a;
+    const batch_file_t *f2 = (const batch_file_t *)b;
+    return f1->size < f2->size ? 1 : f1->size > f2->size ? -1 : 0;
+}
+
+static void batch_schedule(batch_t *B)
+{
+    unsigned i, j, n = ARRAY_size(B->files);
+    qsort(B->files.list, n, sizeof(batch_file_t), batch_file_compare);
+    B->queues = (batch_queue_t *)VM_CALLOC(B->nworker, sizeof(batch_queue_t));
+    for (i = 0; i < B->nworker; i++) {
+        pthread_mutex_init(&B->queues[i].lock, NULL);
+        B->queues[i].files = (unsigned *)VM_MALLOC(sizeof(unsigned) * (n + 1));
+    }
+    for (i = 0; i < n; i++) {
+        batch_queue_t *q = &B->queues[0];
+        for (j = 1; j < B->nworker; j++) {
+            if (B->queues[j].bytes < q->bytes) {
+                q = &B->queues[j];
+            }
+        }
+        q->files[q->tail++] = i;
+        q->bytes += ARRAY_n(B->files, i)->size;
+    }
+}
+
+static batch_file_t *batch_next(batch_t *B, unsigned id)
+{
+    batch_queue_t *q = &B->queues[id];
+    batch_file_t *f = NULL;
+    unsigned i;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        f = ARRAY_n(B->files, q->files[q->head++]);
+        q->bytes -= f->size;
+    }
+    pthread_mutex_unlock(&q->lock);
+    while (f == NULL) {
+        /* the sizes are read unlocked, so the victim is only a guess */
+        batch_queue_t *victim = NULL;
+        for (i = 0; i < B->nworker; i++) {
+            batch_queue_t *v = &B->queues[i];
+            if (v != q && v->head < v->tail &&
+                    (victim == NULL || v->bytes > victim->bytes)) {
+                victim = v;
+            }
+        }
+        if (victim == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            f = ARRAY_n(B->files, victim->files[--victim->tail]);
+            victim->bytes -= f->size;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return f;
+}
+
+static void *batch_worker_main(void *arg)
+{
+    batch_worker_t *w = (batch_worker_t *)arg;
+    moz_program_t *p = w->batch->program;
+    mozvm_loader_t L = {};
+    AstEvents events = {};
+    moz_runtime_t *R;
+    batch_file_t *f;
+
+    NodeManager_init();
+    R = moz_runtime_init(p->C.memo_size, p->C.nterm_size, w->batch->memo_type);
+    moz_runtime_attach(R, p);
+#ifdef MOZVM_ENABLE_JIT
+    moz_runtime_enable_jit(R, w->batch->jit);
+#endif
+    AstMachine_setMode(R->ast, w->batch->ast_mode, &events);
+    while ((f = batch_next(w->batch, w->id)) != NULL) {
+        Node *node;
+        long parsed;
+        w->nfile++;
+        if (!mozvm_loader_load_input(&L, f->path)) {
+            fprintf(stderr, "error: failed to load input_file='%s'\n", f->path);
+            w->nerror++;
+            continue;
+        }
+        moz_runtime_set_source(R, L.input, L.input + L.input_size);
+        parsed = moz_runtime_parse(R, L.input, parse_init(R, L.input, p->inst, w->batch->start));
+        if (parsed != 0) {
+            fprintf(stderr, "parse error%s: %s\n",
+                    parsed == MOZVM_PARSE_STACK_OVERFLOW ? " (stack overflow)" : "",
+                    f->path);
+            w->nerror++;
+        }
+        else if ((node = ast_get_parsed_node(R->ast)) != NULL) {
+            NODE_GC_RELEASE(node);
+        }
+        w->bytes += L.input_size;
+        moz_runtime_reuse(R);
+        mozvm_loader_unload_input(&L);
+    }
+    moz_runtime_dispose(R);
+    NodeManager_dispose();
+    return NULL;
+}
+
+/* returns the number of files that failed; trees are not printed */
+static unsigned long parse_batch(moz_program_t *program, memo_type_t memo_type,
+        ast_mode_t ast_mode, int start, const char *list, unsigned nworker,
+        int jit, unsigned print_stats)
+{
+    batch_t B = {};
+    batch_worker_t *workers;
+    unsigned long nfile = 0, nerror = 0;
+    size_t bytes = 0;
+    unsigned i;
+
+    B.program = program;
+    B.memo_type = memo_type;
+    B.ast_mode = ast_mode;
+    B.start = start;
+    B.jit = jit;
+    B.nworker = nworker;
+    ARRAY_init(batch_file_t, &B.files, 64);
+    batch_add_list(&B, list);
+    batch_schedule(&B);
+
+    workers = (batch_worker_t *)VM_CALLOC(nworker, sizeof(batch_worker_t));
+    reset_timer();
+    for (i = 0; i < nworker; i++) {
+        workers[i].batch = &B;
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, batch_worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "error: failed to start worker %u\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < nworker; i++) {
+        pthread_join(workers[i].thread, NULL);
+        nfile  += workers[i].nfile;
+        nerror += workers[i].nerror;
+        bytes  += workers[i].bytes;
+    }
+    if (print_stats) {
+        _show_timer(list, bytes);
+        fprintf(stderr, "%lu files, %lu errors, %u threads\n", nfile, nerror, nworker);
+    }
+
+    for (i = 0; i < nworker; i++) {
+        pthread_mutex_destroy(&B.queues[i].lock);
+        VM_FREE(B.queues[i].files);
+    }
+    for (i = 0; i < ARRAY_size(B.files); i++) {
+        free(ARRAY_n(B.files, i)->path);
+    }
+    ARRAY_dispose(batch_file_t, &B.files);
+    VM_FREE(B.queues);
+    VM_FREE(workers);
+    return nerror;
+}
+
 #if 0
 static void show_timer(const char *s)
 {
@@ -47,12 +634,25 @@ int main(int argc, char *const argv[])
 
     const char *syntax_file = NULL;
     const char *input_file = NULL;
-    unsigned tmp, loop = 1;
+    const char *memo_profile = NULL;
+    const char *profile_out = NULL;
+    const char *profile_in = NULL;
+    const char *batch_list = NULL;
+    const char *parallel_nterm = NULL;
+    const char *start_nterm = NULL;
+    char **edits = (char **)VM_MALLOC(sizeof(char *) * argc);
+    AstEvents events = {};
+    event_printer_t printer = {};
+    unsigned nedit = 0;
+    unsigned tmp, loop = 1, nworker = 0;
     unsigned print_stats = 0;
     unsigned quiet_mode = 0;
-    int opt;
+    unsigned stream_mode = 0;
+    int opt, memo_type, record_delim = -1, separator = ',', nterm = -1, start = -1;
+    int ast_mode = AST_MODE_TREE;
+    int jit = 0;
 
-    while ((opt = getopt(argc, argv, "qsn:p:i:h")) != -1) {
+    while ((opt = getopt(argc, argv, "qsn:p:i:m:M:P:O:r:b:t:a:e:j:d:x:Jh")) != -1) {
         switch (opt) {
         case 'n':
             tmp = atoi(optarg);
@@ -70,6 +670,56 @@ int main(int argc, char *const argv[])
         case 'i':
             input_file = optarg;
             break;
+        case 'm':
+            memo_type = memo_type_parse(optarg);
+            if (memo_type < 0) {
+                fprintf(stderr, "error: unknown memo type '%s'\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            L.memo_type = (memo_type_t)memo_type;
+            break;
+        case 'M':
+            memo_profile = optarg;
+            break;
+        case 'P':
+            profile_out = optarg;
+            break;
+        case 'O':
+            profile_in = optarg;
+            break;
+        case 'r':
+            record_delim = parse_delimiter(optarg);
+            break;
+        case 'b':
+            batch_list = optarg;
+            break;
+        case 't':
+            nworker = atoi(optarg);
+            break;
+        case 'a':
+            ast_mode = ast_mode_parse(optarg);
+            if (ast_mode < 0) {
+                fprintf(stderr, "error: unknown ast mode '%s'\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            start_nterm = optarg;
+            break;
+        case 'j':
+            parallel_nterm = optarg;
+            break;
+        case 'd':
+            separator = parse_delimiter(optarg);
+            break;
+        case 'x':
+            edits[nedit++] = optarg;
+            break;
+        case 'J':
+            jit = 1;
+            break;
         case 'h':
         default: /* '?' */
             usage(argv[0]);
@@ -81,12 +731,29 @@ int main(int argc, char *const argv[])
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
-    if (input_file == NULL) {
+    if (input_file == NULL && batch_list == NULL) {
         fprintf(stderr, "error: please specify input file\n");
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
-    if (!mozvm_loader_load_input(&L, input_file)) {
+    stream_mode = input_file && strcmp(input_file, "-") == 0;
+    if (start_nterm && parallel_nterm) {
+        fprintf(stderr, "error: -e cannot be used with -j\n");
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (nedit > 0 && (stream_mode || batch_list || record_delim >= 0
+                || parallel_nterm || start_nterm)) {
+        fprintf(stderr, "error: -x cannot be used with -i -, -b, -r, -j or -e\n");
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (ast_mode != AST_MODE_TREE && (parallel_nterm || nedit > 0)) {
+        fprintf(stderr, "error: -a cannot be used with -j or -x\n");
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (input_file && !stream_mode && !mozvm_loader_load_input(&L, input_file)) {
         fprintf(stderr, "error: failed to load input_file='%s'\n", input_file);
         usage(argv[0]);
         exit(EXIT_FAILURE);
@@ -94,9 +761,72 @@ int main(int argc, char *const argv[])
 #if defined(MOZVM_PROFILE) && defined(MOZVM_MEMORY_PROFILE)
         mozvm_mm_snapshot(MOZVM_MM_PROF_EVENT_INPUT_LOAD);
 #endif
+    if (profile_in && !mozvm_loader_load_profile(&L, profile_in)) {
+        fprintf(stderr, "error: failed to load profile='%s'\n", profile_in);
+        exit(EXIT_FAILURE);
+    }
     NodeManager_init();
     head = inst = mozvm_loader_load_file(&L, syntax_file);
     assert(inst != NULL);
+    if (ast_mode == AST_MODE_EVENT && !quiet_mode) {
+        event_printer_init(&printer, &events, L.R->ast);
+    }
+    AstMachine_setMode(L.R->ast, (ast_mode_t)ast_mode, &events);
+#ifdef MOZVM_ENABLE_JIT
+    moz_runtime_enable_jit(L.R, jit);
+#else
+    if (jit) {
+        fprintf(stderr, "warning: the jit is disabled (see MOZVM_ENABLE_JIT)\n");
+    }
+#endif
+    if (start_nterm && (start = moz_runtime_find_nterm(L.R, start_nterm)) < 0) {
+        fprintf(stderr, "error: unknown nonterminal '%s'\n", start_nterm);
+        exit(EXIT_FAILURE);
+    }
+    if (stream_mode) {
+        parse_stream(L.R, head, start, quiet_mode, print_stats);
+        loop = 0;
+    }
+    if (nworker == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworker = ncpu > 0 ? (unsigned)ncpu : 1;
+    }
+#ifdef MOZVM_PROFILE_INST
+    /* the instruction counters are shared by all runtimes and not atomic */
+    nworker = 1;
+#endif
+    if (parallel_nterm && (nterm = moz_runtime_find_nterm(L.R, parallel_nterm)) < 0) {
+        fprintf(stderr, "error: unknown nonterminal '%s'\n", parallel_nterm);
+        exit(EXIT_FAILURE);
+    }
+#ifndef MOZVM_USE_SPECULATIVE_PARSE
+    if (parallel_nterm) {
+        fprintf(stderr, "warning: speculative parsing is disabled\n");
+    }
+#endif
+    if (nedit > 0) {
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+        parse_edits(L.R, head, L.input, L.input_size, edits, nedit, quiet_mode, print_stats);
+#else
+        fprintf(stderr, "warning: incremental parsing is disabled\n");
+#endif
+        loop = 0;
+    }
+    if (batch_list) {
+        for (; loop > 0; loop--) {
+            parse_batch(L.program, L.memo_type, (ast_mode_t)ast_mode, start,
+                    batch_list, nworker, jit, print_stats);
+        }
+    }
+    if (record_delim >= 0) {
+        for (; loop > 0; loop--) {
+            reset_timer();
+            parse_records(L.R, head, start, L.input, L.input_size, record_delim, quiet_mode);
+            if (print_stats) {
+                _show_timer(input_file, L.input_size);
+            }
+        }
+    }
 
     while (loop-- > 0) {
         Node *node = NULL;
@@ -106,10 +836,23 @@ int main(int argc, char *const argv[])
 #if defined(MOZVM_PROFILE) && defined(MOZVM_MEMORY_PROFILE)
         mozvm_mm_snapshot(MOZVM_MM_PROF_EVENT_PARSE_START);
 #endif
-        inst = moz_runtime_parse_init(L.R, L.input, inst);
-        parsed = moz_runtime_parse(L.R, L.input, inst);
+#ifdef MOZVM_USE_SPECULATIVE_PARSE
+        if (nterm >= 0) {
+            parsed = moz_runtime_parse_parallel(L.R, L.input, inst, nterm, separator, nworker);
+        }
+        else
+#endif
+        {
+            inst = parse_init(L.R, L.input, inst, start);
+            parsed = moz_runtime_parse(L.R, L.input, inst);
+        }
         if (parsed != 0) {
-            fprintf(stderr, "parse error\n");
+            if (parsed == MOZVM_PARSE_STACK_OVERFLOW) {
+                fprintf(stderr, "parse error: stack overflow\n");
+            }
+            else {
+                fprintf(stderr, "parse error\n");
+            }
             break;
         }
         node = ast_get_parsed_node(L.R->ast);
@@ -130,9 +873,7 @@ int main(int argc, char *const argv[])
 #if defined(MOZVM_PROFILE) && defined(MOZVM_MEMORY_PROFILE)
         mozvm_mm_snapshot(MOZVM_MM_PROF_EVENT_GC_EXECUTED);
 #endif
-        moz_runtime_reset1(L.R);
-        NodeManager_reset();
-        moz_runtime_reset2(L.R);
+        moz_runtime_reuse(L.R);
     }
     if (print_stats) {
 #if defined(MOZVM_PROFILE) && defined(MOZVM_MEMORY_PROFILE)
@@ -143,8 +884,40 @@ int main(int argc, char *const argv[])
         memo_print_stats();
         moz_runtime_print_stats(L.R);
     }
+    if (memo_profile) {
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+        FILE *fp = fopen(memo_profile, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "error: failed to open '%s'\n", memo_profile);
+        }
+        else {
+            moz_runtime_print_memo_points(L.R, fp);
+            fclose(fp);
+        }
+#else
+        fprintf(stderr, "warning: memo point profiling is disabled\n");
+#endif
+    }
+    if (profile_out) {
+#ifdef MOZVM_PROFILE_INST
+        FILE *fp = fopen(profile_out, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "error: failed to open '%s'\n", profile_out);
+        }
+        else {
+            mozvm_loader_write_profile(&L, fp);
+            fclose(fp);
+        }
+#else
+        fprintf(stderr, "warning: instruction profiling is disabled (see moz_profile)\n");
+#endif
+    }
     moz_runtime_dispose(L.R);
     mozvm_loader_dispose(&L);
+    if (printer.ast) {
+        ARRAY_dispose(event_frame_t, &printer.frames);
+    }
+    VM_FREE(edits);
     NodeManager_dispose();
     return 0;
 }
@@ -1,6 +1,7 @@
 #include "memo.h"
 #include "karray.h"
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #ifdef MOZVM_PROFILE
 #include <stdio.h>
@@ -16,7 +17,8 @@ extern "C" {
     F(MEMO_HIT)     \
     F(MEMO_HITFAIL) \
     F(MEMO_SET)     \
-    F(MEMO_FAIL)
+    F(MEMO_FAIL)    \
+    F(MEMO_SWEEP)
 
 MOZVM_MEMO_PROFILE_EACH(MOZVM_PROFILE_DECL);
 
@@ -24,182 +26,694 @@ DEF_ARRAY_STRUCT0(MemoEntry_t, unsigned);
 DEF_ARRAY_T(MemoEntry_t);
 DEF_ARRAY_OP(MemoEntry_t);
 
+/* result nodes of the entries. Free slots are chained through next and
+ * hold (index << 1) | 1, which no Node pointer looks like. */
+typedef union MemoNode {
+    Node *node;
+    uintptr_t next;
+} MemoNode_t;
+
+DEF_ARRAY_STRUCT0(MemoNode_t, unsigned);
+DEF_ARRAY_T(MemoNode_t);
+DEF_ARRAY_OP(MemoNode_t);
+
 struct memo {
     ARRAY(MemoEntry_t) ary;
+    /* slot 0 is unused so that a result of 0 means "no node" */
+    ARRAY(MemoNode_t) nodes;
+    uint32_t free_node;
+    /* [retain] every entry has a slot in nodes; its reach is kept here */
+    uint32_t *reach;
+    unsigned reach_capacity;
+    /* [retain] live entries in ary */
+    unsigned count;
+    /* MEMO_KEY_VALID and the current generation; see memo_reset() */
+    uint64_t tag;
+    /* positions are keyed by their offset from here; see memo_set_base() */
+    uintptr_t base;
     unsigned shift;
     unsigned mask;
+    memo_type_t type;
+    unsigned n;
+    unsigned window;
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+    /* window size chosen from the statistics below */
+    unsigned target_window;
+    unsigned long stat_get;
+    unsigned long stat_hit;
+    unsigned long stat_set;
+    /* entries overwritten while the parser could still reach them */
+    unsigned long stat_live;
+    unsigned long checkpoint_live;
+#endif
 };
 
-#if defined(MOZVM_MEMO_TYPE_ELASTIC)
-static void memo_elastic_init(memo_t *m, unsigned w, unsigned n)
+/* number of slots searched by MEMO_TYPE_HASH before evicting */
+#define MEMO_HASH_PROBE 8
+
+#define MEMO_ENTRY_EMPTY 0
+
+/* key layout: [valid:1][generation:7][state:8][memoId:16][pos:32] */
+#define MEMO_KEY_VALID    ((uint64_t)1 << 63)
+#define MEMO_KEY_GEN_SHIFT 56
+#define MEMO_KEY_TAG_MASK ((uint64_t)0xff << MEMO_KEY_GEN_SHIFT)
+#define MEMO_GENERATIONS  128
+#define MEMO_KEY_POS(K)   ((uint32_t)(K))
+#define MEMO_KEY_ID(K)    ((uint32_t)((K) >> 32) & 0xffff)
+#define MEMO_NODE_POOL_INIT 16
+
+/* parses with fewer memo_set calls do not change the window */
+#define MEMO_ADAPT_MIN_SAMPLES 256
+
+static const char *memo_type_names[] = {
+    "default", "null", "elastic", "hash", "assoc2", "assoc4", "retain"
+};
+
+static inline uint64_t memo_offset(memo_t *m, mozpos_t pos)
 {
-    unsigned i;
-    unsigned len = w * (1 << LOG2(n));
-    ARRAY_init(MemoEntry_t, &m->ary, len);
-    MemoEntry_t e;;
-    e.hash = 0;
-    e.result = NULL;
-    e.consumed = 0;
-    e.state = 0;
+    return (uint64_t)((uintptr_t)pos - m->base);
+}
+
+/* the key has room for 32 bits of offset; positions further into the
+ * input are not memoized, so that two of them never share a key */
+#define MEMO_OFFSET_OK(OFF) ((OFF) <= UINT32_MAX)
 
-    for (i = 0; i < len; i++) {
-        ARRAY_add(MemoEntry_t, &m->ary, &e);
+static inline uint64_t memo_key(memo_t *m, uint64_t offset, unsigned memoId, unsigned state)
+{
+    return m->tag | ((uint64_t)(state & 0xff) << 48)
+        | ((uint64_t)memoId << 32) | offset;
+}
+
+static inline uintptr_t memo_hash(memo_t *m, uint64_t key)
+{
+    return ((uintptr_t)MEMO_KEY_POS(key) << m->shift) | MEMO_KEY_ID(key);
+}
+
+/* entries of an older generation are as good as empty */
+static inline int memo_entry_live(memo_t *m, MemoEntry_t *e)
+{
+    return (e->key & MEMO_KEY_TAG_MASK) == m->tag;
+}
+
+static uint32_t memo_node_alloc(memo_t *m, Node *node)
+{
+    uint32_t idx = m->free_node;
+    if (idx) {
+        m->free_node = (uint32_t)(ARRAY_get(MemoNode_t, &m->nodes, idx)->next >> 1);
     }
-    m->mask  = len - 1;
-    m->shift = LOG2(n) + 1;
+    else {
+        MemoNode_t empty;
+        empty.node = NULL;
+        idx = ARRAY_size(m->nodes);
+        ARRAY_add(MemoNode_t, &m->nodes, &empty);
+    }
+    ARRAY_get(MemoNode_t, &m->nodes, idx)->node = node;
+    if (m->type == MEMO_TYPE_RETAIN && idx >= m->reach_capacity) {
+        m->reach_capacity = m->nodes.capacity;
+        m->reach = (uint32_t *)VM_REALLOC(m->reach, sizeof(uint32_t) * m->reach_capacity);
+    }
+    return idx;
 }
 
-static int memo_elastic_set(memo_t *m, mozpos_t pos, uint32_t memoId, Node *result, unsigned consumed, int state)
+static void memo_nodes_init(memo_t *m)
 {
-    uintptr_t hash = (((uintptr_t)pos << m->shift) | memoId);
-    unsigned idx = hash & m->mask;
-    MemoEntry_t *e = ARRAY_get(MemoEntry_t, &m->ary, idx);
-    MOZVM_PROFILE_INC(MEMO_SET);
-    if (e->result && e->failed != MEMO_ENTRY_FAILED) {
-        NODE_GC_RELEASE(e->result);
+    MemoNode_t none;
+    none.node = NULL;
+    ARRAY_init(MemoNode_t, &m->nodes, MEMO_NODE_POOL_INIT);
+    ARRAY_add(MemoNode_t, &m->nodes, &none);
+    m->free_node = 0;
+}
+
+/* release every result node and empty the pool; the cost depends on the
+ * number of results stored, not on the size of the table */
+static void memo_nodes_clear(memo_t *m)
+{
+    MemoNode_t *x, *e;
+    FOR_EACH_ARRAY(m->nodes, x, e) {
+        if (x->node && (x->next & 1) == 0) {
+            NODE_GC_RELEASE(x->node);
+        }
     }
-    e->hash = hash;
+    ARRAY_size(m->nodes) = 1;
+    m->free_node = 0;
+}
+
+/* results of older generations went with memo_nodes_clear() */
+static inline void memo_entry_release(memo_t *m, MemoEntry_t *e)
+{
+    if (e->result && memo_entry_live(m, e)) {
+        MemoNode_t *x = ARRAY_get(MemoNode_t, &m->nodes, e->result);
+        if (x->node) {
+            NODE_GC_RELEASE(x->node);
+        }
+        x->next = ((uintptr_t)m->free_node << 1) | 1;
+        m->free_node = e->result;
+        e->result = 0;
+    }
+}
+
+static inline void memo_entry_set(memo_t *m, MemoEntry_t *e, uint64_t key,
+        Node *result, unsigned consumed, uint32_t reach)
+{
+    e->key      = key;
     e->consumed = consumed;
-    e->state    = state;
-    e->result   = result;
-    // ARRAY_set(MemoEntry_t, &m->ary, idx, e);
-    return 1;
+    if (m->type == MEMO_TYPE_RETAIN) {
+        e->result = memo_node_alloc(m, result);
+        m->reach[e->result] = reach;
+    }
+    else {
+        e->result = result ? memo_node_alloc(m, result) : 0;
+    }
 }
 
-static int memo_elastic_fail(memo_t *m, mozpos_t pos, unsigned memoId)
+static inline MemoEntry_t *memo_entry_check(MemoEntry_t *e, uint64_t key)
 {
-    uintptr_t hash = (((uintptr_t)pos << m->shift) | memoId);
-    unsigned idx = hash & m->mask;
-    MemoEntry_t *old = ARRAY_get(MemoEntry_t, &m->ary, idx);
-    MOZVM_PROFILE_INC(MEMO_FAIL);
-    if (old->result && old->failed != MEMO_ENTRY_FAILED) {
-        NODE_GC_RELEASE(old->result);
+    if (e->key == key) {
+        if (e->consumed == MEMO_ENTRY_FAILED) {
+            MOZVM_PROFILE_INC(MEMO_HITFAIL);
+        }
+        else {
+            MOZVM_PROFILE_INC(MEMO_HIT);
+        }
+        return e;
     }
-    old->hash = hash;
-    old->failed = MEMO_ENTRY_FAILED;
-    return 0;
+    return NULL;
 }
 
-static MemoEntry_t *memo_elastic_get(memo_t *m, mozpos_t pos, unsigned memoId, unsigned state)
+/* [elastic] direct-mapped table */
+static MemoEntry_t *memo_elastic_lookup(memo_t *m, uint64_t key)
 {
-    uintptr_t hash = (((uintptr_t)pos << m->shift) | memoId);
-    unsigned idx = hash & m->mask;
-    MemoEntry_t *e = ARRAY_get(MemoEntry_t, &m->ary, idx);
-    MOZVM_PROFILE_INC(MEMO_GET);
-    if (e->hash == hash) {
-        if (e->state == state) {
-            if (e->failed == MEMO_ENTRY_FAILED) {
-                MOZVM_PROFILE_INC(MEMO_HITFAIL);
-            }
-            else {
-                MOZVM_PROFILE_INC(MEMO_HIT);
-            }
+    return ARRAY_get(MemoEntry_t, &m->ary, memo_hash(m, key) & m->mask);
+}
+
+/* [hash] open addressing with linear probing. When the probe window is
+ * full, the entry at the lowest input position is evicted. */
+static MemoEntry_t *memo_hash_lookup(memo_t *m, uint64_t key)
+{
+    unsigned i, idx = memo_hash(m, key) & m->mask;
+    MemoEntry_t *victim = ARRAY_get(MemoEntry_t, &m->ary, idx);
+    for (i = 0; i < MEMO_HASH_PROBE; i++) {
+        MemoEntry_t *e = ARRAY_get(MemoEntry_t, &m->ary, (idx + i) & m->mask);
+        if (e->key == key || !memo_entry_live(m, e)) {
             return e;
         }
+        if (MEMO_KEY_POS(e->key) < MEMO_KEY_POS(victim->key)) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+static MemoEntry_t *memo_hash_get(memo_t *m, uint64_t key)
+{
+    unsigned i, idx = memo_hash(m, key) & m->mask;
+    for (i = 0; i < MEMO_HASH_PROBE; i++) {
+        MemoEntry_t *e = ARRAY_get(MemoEntry_t, &m->ary, (idx + i) & m->mask);
+        if (e->key == key) {
+            return e;
+        }
+        if (e->key == MEMO_ENTRY_EMPTY) {
+            break;
+        }
     }
-    MOZVM_PROFILE_INC(MEMO_MISS);
     return NULL;
 }
 
-static void memo_elastic_dispose(memo_t *m)
+/* [assoc] N-way set associative table. Entries in a set are kept in LRU
+ * order, so the most recently used entry is always at way 0. */
+static MemoEntry_t *memo_assoc_move_front(MemoEntry_t *set, unsigned way)
+{
+    MemoEntry_t tmp;
+    if (way > 0) {
+        tmp = set[way];
+        memmove(set + 1, set, sizeof(MemoEntry_t) * way);
+        set[0] = tmp;
+    }
+    return set;
+}
+
+static MemoEntry_t *memo_assoc_lookup(memo_t *m, uint64_t key, unsigned ways)
 {
     unsigned i;
-    for (i = 0; i < ARRAY_size(m->ary); i++) {
-        MemoEntry_t *e = ARRAY_get(MemoEntry_t, &m->ary, i);
-        if (e->result && e->failed != MEMO_ENTRY_FAILED) {
-            NODE_GC_RELEASE(e->result);
+    MemoEntry_t *set = ARRAY_get(MemoEntry_t, &m->ary, (memo_hash(m, key) & m->mask) * ways);
+    unsigned victim = ways - 1;
+    for (i = 0; i < ways; i++) {
+        if (set[i].key == key) {
+            return memo_assoc_move_front(set, i);
         }
     }
-    memset(m->ary.list, 0, sizeof(MemoEntry_t) * ARRAY_size(m->ary));
-    ARRAY_dispose(MemoEntry_t, &m->ary);
+    /* reuse an empty or stale way before evicting the least recently used */
+    for (i = 0; i < ways - 1; i++) {
+        if (!memo_entry_live(m, set + i)) {
+            victim = i;
+            break;
+        }
+    }
+    memo_entry_release(m, set + victim);
+    return memo_assoc_move_front(set, victim);
 }
 
-#elif defined(MOZVM_MEMO_TYPE_HASH)
-#else  /* MOZVM_MEMO_TYPE_NULL */
-static void memo_null_init(memo_t *memo, unsigned w, unsigned n)
+static MemoEntry_t *memo_assoc_get(memo_t *m, uint64_t key, unsigned ways)
 {
-    /* do nothing */
+    unsigned i;
+    MemoEntry_t *set = ARRAY_get(MemoEntry_t, &m->ary, (memo_hash(m, key) & m->mask) * ways);
+    for (i = 0; i < ways; i++) {
+        if (set[i].key == key) {
+            return memo_assoc_move_front(set, i);
+        }
+    }
+    return NULL;
 }
 
-static int memo_null_set(memo_t *m, mozpos_t pos, unsigned memoId, MemoEntry_t *e)
+/* [retain] open addressing with linear probing that grows the table at
+ * half load instead of evicting, so that an incremental reparse finds
+ * every entry of the last parse. Slots are only emptied by memo_edit(),
+ * which rebuilds the table, so a probe may stop at the first one. */
+static void memo_rehash(memo_t *m, unsigned w);
+
+static MemoEntry_t *memo_retain_probe(memo_t *m, uint64_t key)
 {
-    return 0;
+    unsigned idx = (unsigned)(((key & ~MEMO_KEY_TAG_MASK) * 0x9e3779b97f4a7c15ULL) >> 32) & m->mask;
+    MemoEntry_t *e = ARRAY_get(MemoEntry_t, &m->ary, idx);
+    while (e->key != key && memo_entry_live(m, e)) {
+        idx = (idx + 1) & m->mask;
+        e = ARRAY_get(MemoEntry_t, &m->ary, idx);
+    }
+    return e;
 }
 
-static int memo_null_fail(memo_t *m, mozpos_t pos, unsigned memoId)
+static MemoEntry_t *memo_retain_lookup(memo_t *m, uint64_t key)
 {
-    return 0;
+    MemoEntry_t *e = memo_retain_probe(m, key);
+    if (e->key != key) {
+        if ((m->count + 1) * 2 > ARRAY_size(m->ary)) {
+            memo_rehash(m, m->window * 2);
+            e = memo_retain_probe(m, key);
+        }
+        m->count++;
+    }
+    return e;
 }
 
-static MemoEntry_t *memo_null_get(memo_t *m, mozpos_t pos, unsigned memoId, unsigned state)
+static unsigned memo_type_ways(memo_type_t type)
 {
-    return NULL;
+    switch (type) {
+    case MEMO_TYPE_ASSOC2: return 2;
+    case MEMO_TYPE_ASSOC4: return 4;
+    default: return 1;
+    }
 }
 
-static void memo_null_dispose(memo_t *memo)
+/* returns the slot that should hold key (NULL if memoization is off) */
+static MemoEntry_t *memo_lookup(memo_t *m, uint64_t key)
 {
-    /* do nothing */
+    switch (m->type) {
+    case MEMO_TYPE_ELASTIC:
+        return memo_elastic_lookup(m, key);
+    case MEMO_TYPE_HASH:
+        return memo_hash_lookup(m, key);
+    case MEMO_TYPE_ASSOC2:
+        return memo_assoc_lookup(m, key, 2);
+    case MEMO_TYPE_ASSOC4:
+        return memo_assoc_lookup(m, key, 4);
+    case MEMO_TYPE_RETAIN:
+        return memo_retain_lookup(m, key);
+    default:
+        return NULL;
+    }
 }
-#endif
 
-memo_t *memo_init(unsigned w, unsigned n)
+memo_type_t memo_type_default(void)
 {
-    memo_t *memo = (memo_t *)VM_MALLOC(sizeof(*memo));
 #if defined(MOZVM_MEMO_TYPE_ELASTIC)
-    memo_elastic_init(memo, w, n);
+    return MEMO_TYPE_ELASTIC;
 #elif defined(MOZVM_MEMO_TYPE_HASH)
+    return MEMO_TYPE_HASH;
 #else  /* MOZVM_MEMO_TYPE_NULL */
-    memo_null_init(memo, w, n);
+    return MEMO_TYPE_NULL;
 #endif
-    return memo;
 }
 
-void memo_dispose(memo_t *memo)
+int memo_type_parse(const char *name)
 {
-#if defined(MOZVM_MEMO_TYPE_ELASTIC)
-    memo_elastic_dispose(memo);
-#elif defined(MOZVM_MEMO_TYPE_HASH)
-#else  /* MOZVM_MEMO_TYPE_NULL */
-    memo_null_dispose(memo);
+    unsigned i;
+    for (i = 0; i < sizeof(memo_type_names) / sizeof(memo_type_names[0]); i++) {
+        if (strcmp(name, memo_type_names[i]) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+const char *memo_type_name(memo_type_t type)
+{
+    return memo_type_names[type];
+}
+
+static void memo_table_init(memo_t *m, unsigned w)
+{
+    unsigned len = w * (1 << LOG2(m->n));
+    if (m->type == MEMO_TYPE_NULL) {
+        len = 0;
+    }
+    ARRAY_init(MemoEntry_t, &m->ary, len);
+    memset(m->ary.list, 0, sizeof(MemoEntry_t) * len);
+    ARRAY_size(m->ary) = len;
+    m->mask   = len / memo_type_ways(m->type) - 1;
+    m->window = w;
+}
+
+memo_t *memo_init(unsigned w, unsigned n, memo_type_t type)
+{
+    memo_t *m = (memo_t *)VM_MALLOC(sizeof(*m));
+    if (type == MEMO_TYPE_DEFAULT) {
+        type = memo_type_default();
+    }
+    m->type  = type;
+    m->n     = n;
+    m->shift = LOG2(n) + 1;
+    m->tag   = MEMO_KEY_VALID;
+    m->base  = 0;
+    m->reach = NULL;
+    m->reach_capacity = 0;
+    m->count = 0;
+    memo_nodes_init(m);
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+    m->target_window = w;
+    m->stat_get = m->stat_hit = m->stat_set = 0;
+    m->stat_live = m->checkpoint_live = 0;
+    /* the real table is sized by memo_reserve() once the input is known */
+    w = MOZ_MEMO_MIN_WINDOW_SIZE;
 #endif
-    VM_FREE(memo);
+    memo_table_init(m, w);
+    return m;
+}
+
+/* move live entries into a table of window size w */
+static void memo_rehash(memo_t *m, unsigned w)
+{
+    ARRAY(MemoEntry_t) old = m->ary;
+    MemoEntry_t *x, *e;
+    memo_table_init(m, w);
+    m->count = 0;
+    FOR_EACH_ARRAY(old, x, e) {
+        MemoEntry_t *slot;
+        if (!memo_entry_live(m, x)) {
+            memo_entry_release(m, x);
+            continue;
+        }
+        slot = memo_lookup(m, x->key);
+        memo_entry_release(m, slot);
+        *slot = *x;
+    }
+    ARRAY_dispose(MemoEntry_t, &old);
+}
+
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+static unsigned memo_fit_window(memo_t *m, size_t input_size)
+{
+    /* a table of window w keeps w / 2 positions for every memo point */
+    unsigned w = MOZ_MEMO_MIN_WINDOW_SIZE;
+    while (w < m->target_window && w / 2 < input_size) {
+        w *= 2;
+    }
+    return w;
+}
+
+/* checkpoint during a long parse: grow if recent entries are thrown away */
+static void memo_checkpoint(memo_t *m)
+{
+    unsigned long live = m->stat_live - m->checkpoint_live;
+    m->checkpoint_live = m->stat_live;
+    if (live * 16 > MOZ_MEMO_ADAPT_INTERVAL && m->window < MOZ_MEMO_MAX_WINDOW_SIZE) {
+        m->target_window = m->window * 2;
+        memo_rehash(m, m->target_window);
+    }
+}
+
+/* between parses: shrink windows that are not paying off */
+static void memo_adapt(memo_t *m)
+{
+    if (m->stat_set < MEMO_ADAPT_MIN_SAMPLES) {
+        /* too few samples to tell */
+    }
+    else if (m->stat_live * 16 > m->stat_set) {
+        if (m->target_window < MOZ_MEMO_MAX_WINDOW_SIZE) {
+            m->target_window *= 2;
+        }
+    }
+    else if (m->stat_live == 0 && m->stat_hit * 64 < m->stat_get) {
+        if (m->target_window > MOZ_MEMO_MIN_WINDOW_SIZE) {
+            m->target_window /= 2;
+        }
+    }
+    m->stat_get = m->stat_hit = m->stat_set = 0;
+    m->stat_live = m->checkpoint_live = 0;
+}
+#endif
+
+void memo_reserve(memo_t *m, size_t input_size)
+{
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+    /* a retain table is sized by its entries, not by the input */
+    unsigned w = memo_fit_window(m, input_size);
+    if (m->type != MEMO_TYPE_RETAIN && w != m->window) {
+        memo_rehash(m, w);
+    }
+#endif
+    (void)m; (void)input_size;
+}
+
+/*
+ * Start over without touching the table: bumping the generation in the
+ * key makes every entry of the previous parse miss, and the result nodes
+ * are released from the pool, so the cost is proportional to the number
+ * of results stored, not to the table. Only when the generation wraps
+ * around, once every MEMO_GENERATIONS resets, is the table really cleared.
+ */
+void memo_reset(memo_t *m)
+{
+    uint64_t gen = ((m->tag & ~MEMO_KEY_VALID) >> MEMO_KEY_GEN_SHIFT) + 1;
+    memo_nodes_clear(m);
+    m->count = 0;
+    if (gen == MEMO_GENERATIONS) {
+        memset(m->ary.list, 0, sizeof(MemoEntry_t) * ARRAY_size(m->ary));
+        gen = 0;
+    }
+    m->tag = MEMO_KEY_VALID | (gen << MEMO_KEY_GEN_SHIFT);
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+    memo_adapt(m);
+#endif
+}
+
+void memo_set_base(memo_t *m, mozpos_t base)
+{
+    m->base = (uintptr_t)base;
+}
+
+/* Emptied slots may cut a linear probe chain short, which only costs a miss. */
+void memo_sweep(memo_t *m, mozpos_t frontier)
+{
+    uint64_t f = memo_offset(m, frontier);
+    MemoEntry_t *x, *e;
+    MOZVM_PROFILE_INC(MEMO_SWEEP);
+    if (m->type == MEMO_TYPE_RETAIN) {
+        /* the entries are kept for the next parse */
+        return;
+    }
+    FOR_EACH_ARRAY(m->ary, x, e) {
+        if (x->key != MEMO_ENTRY_EMPTY && MEMO_KEY_POS(x->key) < f) {
+            memo_entry_release(m, x);
+            x->key = MEMO_ENTRY_EMPTY;
+        }
+    }
+}
+
+void memo_dispose(memo_t *m)
+{
+    memo_nodes_clear(m);
+    ARRAY_dispose(MemoEntry_t, &m->ary);
+    ARRAY_dispose(MemoNode_t, &m->nodes);
+    if (m->reach) {
+        VM_FREE(m->reach);
+    }
+    VM_FREE(m);
 }
 
 MemoEntry_t *memo_get(memo_t *m, mozpos_t pos, uint32_t memoId, uint8_t state)
 {
-#if defined(MOZVM_MEMO_TYPE_ELASTIC)
-    return memo_elastic_get(m, pos, memoId, state);
-#elif defined(MOZVM_MEMO_TYPE_HASH)
-#else  /* MOZVM_MEMO_TYPE_NULL */
-    return memo_null_get(m, pos, memoId, state);
+    uint64_t offset = memo_offset(m, pos);
+    uint64_t key = memo_key(m, offset, memoId, state);
+    MemoEntry_t *e = NULL;
+    MOZVM_PROFILE_INC(MEMO_GET);
+    if (!MEMO_OFFSET_OK(offset)) {
+        return NULL;
+    }
+    switch (m->type) {
+    case MEMO_TYPE_ELASTIC:
+        e = memo_elastic_lookup(m, key);
+        break;
+    case MEMO_TYPE_HASH:
+        e = memo_hash_get(m, key);
+        break;
+    case MEMO_TYPE_ASSOC2:
+        e = memo_assoc_get(m, key, 2);
+        break;
+    case MEMO_TYPE_ASSOC4:
+        e = memo_assoc_get(m, key, 4);
+        break;
+    case MEMO_TYPE_RETAIN:
+        e = memo_retain_probe(m, key);
+        break;
+    default:
+        break;
+    }
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+    m->stat_get++;
 #endif
+    if (e && (e = memo_entry_check(e, key)) != NULL) {
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+        m->stat_hit++;
+#endif
+        return e;
+    }
+    MOZVM_PROFILE_INC(MEMO_MISS);
+    return NULL;
 }
 
-int memo_fail(memo_t *m, mozpos_t pos, uint32_t memoId)
+/*
+ * An entry is still live if it lies beyond the position the parser has
+ * reached: the parser backtracked behind it and will come back to it.
+ * The assoc backends have already dropped the LRU entry by the time we
+ * see the slot, so only elastic and hash are measured.
+ */
+static inline void memo_count_overwrite(memo_t *m, MemoEntry_t *e, uint64_t key, uint64_t frontier)
 {
-#if defined(MOZVM_MEMO_TYPE_ELASTIC)
-    return memo_elastic_fail(m, pos, memoId);
-#elif defined(MOZVM_MEMO_TYPE_HASH)
-#else  /* MOZVM_MEMO_TYPE_NULL */
-    return memo_null_fail(m, pos, memoId);
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+    if (memo_entry_live(m, e) && e->key != key
+            && MEMO_KEY_POS(e->key) > frontier) {
+        m->stat_live++;
+    }
+#endif
+    (void)m; (void)e; (void)key; (void)frontier;
+}
+
+/* called after an entry is stored; may rehash the table */
+static inline void memo_tick(memo_t *m)
+{
+#ifdef MOZVM_MEMO_USE_ADAPTIVE_WINDOW
+    if ((++m->stat_set & (MOZ_MEMO_ADAPT_INTERVAL - 1)) == 0) {
+        memo_checkpoint(m);
+    }
 #endif
+    (void)m;
 }
 
-int memo_set(memo_t *m, mozpos_t pos, uint32_t memoId, Node *result, unsigned consumed, int state)
+int memo_fail(memo_t *m, mozpos_t pos, uint32_t memoId, uint32_t reach)
 {
+    uint64_t offset = memo_offset(m, pos);
+    uint64_t key = memo_key(m, offset, memoId, 0);
+    MemoEntry_t *e;
+    MOZVM_PROFILE_INC(MEMO_FAIL);
+    if (!MEMO_OFFSET_OK(offset)) {
+        return 0;
+    }
+    if ((e = memo_lookup(m, key)) != NULL) {
+        memo_entry_release(m, e);
+        memo_entry_set(m, e, key, NULL, MEMO_ENTRY_FAILED, reach);
+        memo_tick(m);
+    }
+    return 0;
+}
+
+int memo_set(memo_t *m, mozpos_t pos, uint32_t memoId, Node *result, unsigned consumed, int state, uint32_t reach)
+{
+    uint64_t offset = memo_offset(m, pos);
+    uint64_t key = memo_key(m, offset, memoId, state);
+    MemoEntry_t *e;
+    MOZVM_PROFILE_INC(MEMO_SET);
+    /* such a span cannot be told apart from a failure */
+    if (consumed >= MEMO_ENTRY_FAILED || !MEMO_OFFSET_OK(offset)) {
+        return 0;
+    }
+    if ((e = memo_lookup(m, key)) == NULL) {
+        return 0;
+    }
     if (result) {
         NODE_GC_RETAIN(result);
     }
-#if defined(MOZVM_MEMO_TYPE_ELASTIC)
-    return memo_elastic_set(m, pos, memoId, result, consumed, state);
-#elif defined(MOZVM_MEMO_TYPE_HASH)
-    MemoEntry_t e;
-    e.consumed = consumed;
-    e.state    = state;
-    e.result   = result;
-#else  /* MOZVM_MEMO_TYPE_NULL */
-    return memo_null_set(m, pos, memoId, &e);
-#endif
+    memo_count_overwrite(m, e, key, offset + consumed);
+    memo_entry_release(m, e);
+    memo_entry_set(m, e, key, result, consumed, reach);
+    memo_tick(m);
+    return 1;
+}
+
+Node *memo_entry_result(memo_t *m, MemoEntry_t *e)
+{
+    return ARRAY_get(MemoNode_t, &m->nodes, e->result)->node;
+}
+
+uint32_t memo_entry_reach(memo_t *m, MemoEntry_t *e)
+{
+    return m->type == MEMO_TYPE_RETAIN ? m->reach[e->result] : MEMO_REACH_UNKNOWN;
+}
+
+/*
+ * Rebuilding the table costs O(table), and moving the nodes O(nodes after
+ * the edit), both well below what parsing that part again would. Entries
+ * moved past the offsets a key can hold are dropped.
+ */
+void memo_edit(memo_t *m, mozpos_t begin, mozpos_t end, long delta, unsigned lookahead)
+{
+    ARRAY(MemoEntry_t) old;
+    MemoEntry_t *x, *e;
+    Node **moved;
+    unsigned nmoved = 0, capacity = 64;
+    int64_t b = (int64_t)memo_offset(m, begin);
+    int64_t f = (int64_t)memo_offset(m, end);
+
+    if (m->type != MEMO_TYPE_RETAIN) {
+        memo_reset(m);
+        return;
+    }
+    old = m->ary;
+    moved = (Node **)VM_MALLOC(sizeof(Node *) * capacity);
+    memo_table_init(m, m->window);
+    m->count = 0;
+    FOR_EACH_ARRAY(old, x, e) {
+        int64_t before = (int64_t)MEMO_KEY_POS(x->key) - b;
+        int64_t moved_to = (int64_t)MEMO_KEY_POS(x->key) + delta;
+        uint64_t key = x->key;
+        MemoEntry_t *slot;
+        Node *node;
+        if (!memo_entry_live(m, x)) {
+            continue;
+        }
+        if (before + (int64_t)m->reach[x->result] + lookahead <= 0) {
+            /* the edit is out of its sight */
+        }
+        else if ((int64_t)MEMO_KEY_POS(key) >= f && MEMO_OFFSET_OK((uint64_t)moved_to)) {
+            key = (key & ~(uint64_t)UINT32_MAX) | (uint64_t)moved_to;
+            if ((node = memo_entry_result(m, x)) != NULL) {
+                if (nmoved == capacity) {
+                    capacity *= 2;
+                    moved = (Node **)VM_REALLOC(moved, sizeof(Node *) * capacity);
+                }
+                moved[nmoved++] = node;
+            }
+        }
+        else {
+            memo_entry_release(m, x);
+            continue;
+        }
+        slot = memo_lookup(m, key);
+        *slot = *x;
+        slot->key = key;
+    }
+    Node_relocate(moved, nmoved, delta);
+    VM_FREE(moved);
+    ARRAY_dispose(MemoEntry_t, &old);
 }
 
 void memo_print_stats()
@@ -211,14 +725,12 @@ void memo_print_stats()
 void memo_trace(void *p, NodeVisitor *visitor)
 {
     memo_t *m = (memo_t *)p;
-#if defined(MOZVM_MEMO_TYPE_ELASTIC)
     MemoEntry_t *x, *e;
     FOR_EACH_ARRAY(m->ary, x, e) {
-        if (x->result && x->failed != MEMO_ENTRY_FAILED) {
-            visitor->fn_visit(visitor, x->result);
+        if (x->result && memo_entry_live(m, x)) {
+            visitor->fn_visit(visitor, memo_entry_result(m, x));
         }
     }
-#endif
 }
 #endif
 
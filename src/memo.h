@@ -11,32 +11,112 @@ extern "C" {
 
 typedef struct MemoPoint {
     unsigned penalty;
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+    unsigned disabled;
+    /* never disabled; an incremental reparse needs every entry */
+    unsigned pinned;
+    unsigned long lookup;
+    unsigned long hit;
+    unsigned long fail_hit;
+    /* bytes the hits did not have to parse again */
+    unsigned long skipped;
+#endif
 } MemoPoint;
 
 #define MEMO_PENALTY (4)
 
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+/* a failed hit saves an unknown amount of work; count it as one byte */
+static inline void memo_point_lookup(MemoPoint *mp)
+{
+    if ((++mp->lookup & (MOZ_MEMO_POINT_PROBATION - 1)) == 0 && !mp->pinned
+            && (mp->skipped + mp->fail_hit) * MOZ_MEMO_POINT_PAYOFF < mp->lookup) {
+        mp->disabled = 1;
+    }
+}
+
+#define MEMO_POINT_LOOKUP(MP)        memo_point_lookup(MP)
+#define MEMO_POINT_HIT(MP, CONSUMED) ((MP)->hit++, (MP)->skipped += (CONSUMED))
+#define MEMO_POINT_FAIL_HIT(MP)      ((MP)->fail_hit++)
+#else
+#define MEMO_POINT_LOOKUP(MP)        ((void)0)
+#define MEMO_POINT_HIT(MP, CONSUMED) ((void)0)
+#define MEMO_POINT_FAIL_HIT(MP)      ((void)0)
+#endif
+
+/*
+ * 16 bytes, so a cache line holds four entries and a probe never straddles
+ * two lines. The key packs the offset of the position from the base of
+ * the input (32 bits; see memo_set_base()), the memoId,
+ * the state and the generation of the parse that stored it; the result
+ * node lives in a side pool of the table and is only read on a TLookup
+ * hit (see memo_entry_result()).
+ */
 typedef struct MemoEntry {
-    uintptr_t hash;
-    union {
-        Node *result;
-        uintptr_t failed;
-    };
-    unsigned consumed;
-    unsigned state;
+    uint64_t key;
+    uint32_t consumed;
+    uint32_t result;
 } MemoEntry_t;
 
-#define MEMO_ENTRY_FAILED UINTPTR_MAX
+#define MEMO_ENTRY_FAILED UINT32_MAX
+/* how far an entry looked ahead, when the caller did not track it */
+#define MEMO_REACH_UNKNOWN UINT32_MAX
 
 struct memo;
 typedef struct memo memo_t;
 
-memo_t *memo_init(unsigned w, unsigned n);
+typedef enum memo_type {
+    MEMO_TYPE_DEFAULT = 0, /* selected by MOZVM_MEMO_TYPE_* */
+    MEMO_TYPE_NULL,
+    MEMO_TYPE_ELASTIC,     /* direct-mapped */
+    MEMO_TYPE_HASH,        /* open addressing, linear probing */
+    MEMO_TYPE_ASSOC2,      /* 2-way set associative, LRU */
+    MEMO_TYPE_ASSOC4,      /* 4-way set associative, LRU */
+    MEMO_TYPE_RETAIN       /* grows instead of evicting; see memo_edit() */
+} memo_type_t;
+
+memo_type_t memo_type_default(void);
+/* returns -1 if name is not a memo type */
+int memo_type_parse(const char *name);
+const char *memo_type_name(memo_type_t type);
+
+memo_t *memo_init(unsigned w, unsigned n, memo_type_t type);
 void memo_dispose(memo_t *memo);
+/*
+ * drop all entries by moving to a new generation, without clearing the
+ * table (see memo.c); the adaptive window is resized from the last parse
+ */
+void memo_reset(memo_t *memo);
+/* size the table for an input of input_size bytes */
+void memo_reserve(memo_t *memo, size_t input_size);
+/*
+ * Entries are keyed by their offset from base, the start of the input,
+ * and only the first 4 GiB past it are memoized: the key has room for 32
+ * bits of offset, and positions 4 GiB apart must not share an entry.
+ */
+void memo_set_base(memo_t *memo, mozpos_t base);
+/* release every entry at a position before frontier */
+void memo_sweep(memo_t *memo, mozpos_t frontier);
 void memo_print_stats();
 
-int memo_set(memo_t *memo, mozpos_t pos, uint32_t memoId, Node *n, unsigned consumed, int state);
-int memo_fail(memo_t *memo, mozpos_t pos, uint32_t memoId);
+/*
+ * reach is how far past pos the parse that produced the entry went before
+ * it ended or failed (MEMO_REACH_UNKNOWN if nobody kept track); only
+ * MEMO_TYPE_RETAIN stores it.
+ */
+int memo_set(memo_t *memo, mozpos_t pos, uint32_t memoId, Node *n, unsigned consumed, int state, uint32_t reach);
+int memo_fail(memo_t *memo, mozpos_t pos, uint32_t memoId, uint32_t reach);
 MemoEntry_t *memo_get(memo_t *memo, mozpos_t pos, uint32_t memoId, uint8_t state);
+Node *memo_entry_result(memo_t *memo, MemoEntry_t *e);
+uint32_t memo_entry_reach(memo_t *memo, MemoEntry_t *e);
+/*
+ * The input was edited in place: [begin, end) was replaced by
+ * end - begin + delta other bytes. A MEMO_TYPE_RETAIN table keeps every
+ * entry whose parse stayed lookahead bytes clear of begin, moves the ones
+ * at or after end by delta together with their result nodes, and drops
+ * the rest. Other tables are reset.
+ */
+void memo_edit(memo_t *memo, mozpos_t begin, mozpos_t end, long delta, unsigned lookahead);
 
 #ifdef MOZVM_MEMORY_USE_MSGC
 void memo_trace(void *p, NodeVisitor *visitor);
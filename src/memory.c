@@ -3,7 +3,7 @@
 #include <stdlib.h>
 
 #if defined(MOZVM_PROFILE) && defined(MOZVM_MEMORY_PROFILE)
-static uint64_t profile[MOZVM_MM_PROF_EVENT_MAX] = {};
+static MOZVM_THREAD_LOCAL uint64_t profile[MOZVM_MM_PROF_EVENT_MAX] = {};
 
 #define MOZVM_MM_PROFILE_EACH(F) \
     F(MM_MEMORY_MALLOCED)
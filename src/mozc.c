@@ -0,0 +1,805 @@
+/*
+ * mozc: ahead-of-time compiler from nez bytecode (.nzc) to C.
+ *
+ * The bytecode is decoded by the loader (so jumps, jump tables and
+ * constants are exactly what the vm sees) and every nonterminal is
+ * emitted as a C function. Compiled code uses the same frame layout as
+ * the vm and calls into libnez for ast/memo/symbol table operations.
+ */
+#include "mozvm.h"
+#include "loader.h"
+#define MOZVM_DUMP_OPCODE 1
+#include "instruction.h"
+#include "pstring.h"
+#include "karray.h"
+#ifdef MOZVM_USE_JMPTBL
+#include "jmptbl.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define MOZVM_OPCODE_SIZE 1
+#include "vm_inst.h"
+
+#if !defined(MOZVM_USE_POINTER_AS_POS_REGISTER) || defined(MOZVM_USE_DIRECT_THREADING)
+#error "mozc requires MOZVM_USE_POINTER_AS_POS_REGISTER and 1-byte opcodes"
+#endif
+
+typedef struct mozc_func_t {
+    unsigned begin;
+    int nterm; /* -1 for entry point */
+} mozc_func_t;
+
+DEF_ARRAY_STRUCT0(mozc_func_t, unsigned);
+DEF_ARRAY_T(mozc_func_t);
+DEF_ARRAY_OP(mozc_func_t);
+
+typedef struct mozc_t {
+    mozvm_loader_t *L;
+    moz_runtime_t *R;
+    moz_inst_t *inst;
+    unsigned inst_size;
+    FILE *out;
+    const char *prefix;
+    ARRAY(mozc_func_t) funcs;
+    /* per function work area */
+    uint8_t *reachable;
+    uint8_t *labeled;
+    unsigned *worklist;
+} mozc_t;
+
+static void usage(const char *arg)
+{
+    fprintf(stderr, "Usage: %s -p <bytecode_file> [-o <output.c>] [-n <prefix>]"
+            " [-O <profile>]\n", arg);
+}
+
+#define READ(T, P) (*(T *)(P))
+
+static int find_func(mozc_t *C, unsigned begin)
+{
+    mozc_func_t *x, *e;
+    FOR_EACH_ARRAY(C->funcs, x, e) {
+        if (x->begin == begin) {
+            return x - ARRAY_n(C->funcs, 0);
+        }
+    }
+    return -1;
+}
+
+static int add_func(mozc_t *C, unsigned begin, int nterm)
+{
+    mozc_func_t f;
+    int id = find_func(C, begin);
+    if (id >= 0) {
+        return id;
+    }
+    f.begin = begin;
+    f.nterm = nterm;
+    ARRAY_add(mozc_func_t, &C->funcs, &f);
+    return ARRAY_size(C->funcs) - 1;
+}
+
+static int table_jump(mozc_t *C, const moz_inst_t *p, unsigned ch)
+{
+    uint8_t opcode = *p;
+    uint16_t id = READ(uint16_t, p + 1);
+    switch (opcode) {
+    case First:
+        return JMPTBL_GET_IMPL(C->R, id)[ch];
+#ifdef MOZVM_USE_JMPTBL
+    case TblJump1:
+        return jump_table1_jump(C->R->C.jumps1 + id, ch);
+    case TblJump2:
+        return jump_table2_jump(C->R->C.jumps2 + id, ch);
+    case TblJump3:
+        return jump_table3_jump(C->R->C.jumps3 + id, ch);
+#endif
+    }
+    assert(0 && "unreachable");
+    return 0;
+}
+
+static int is_table(uint8_t opcode)
+{
+    return opcode == First || opcode == TblJump1
+        || opcode == TblJump2 || opcode == TblJump3;
+}
+
+/* offset of the operand that holds the jump target (relative to end of inst) */
+static int jump_operand(uint8_t opcode, int *offset)
+{
+    switch (opcode) {
+    case Alt:
+    case Jump:
+        *offset = MOZVM_INST_HEADER_SIZE;
+        return 1;
+    case Lookup:
+        *offset = MOZVM_INST_HEADER_SIZE + sizeof(uint8_t) + sizeof(uint16_t);
+        return 1;
+    case TLookup:
+        *offset = MOZVM_INST_HEADER_SIZE + sizeof(uint8_t) + sizeof(TAG_t) + sizeof(uint16_t);
+        return 1;
+    case Call:
+        /* return address */
+#ifdef MOZVM_USE_NTERM
+        *offset = MOZVM_INST_HEADER_SIZE + sizeof(uint16_t);
+#else
+        *offset = MOZVM_INST_HEADER_SIZE;
+#endif
+        return 1;
+    }
+    *offset = 0;
+    return 0;
+}
+
+static void push_target(mozc_t *C, unsigned *sp, unsigned target, int label)
+{
+    assert(target < C->inst_size);
+    if (label) {
+        C->labeled[target] = 1;
+    }
+    if (!C->reachable[target]) {
+        C->reachable[target] = 1;
+        C->worklist[(*sp)++] = target;
+    }
+}
+
+/* collect instructions reachable from func->begin without leaving the nterm */
+static int mozc_scan(mozc_t *C, mozc_func_t *func)
+{
+    unsigned sp = 0;
+    memset(C->reachable, 0, C->inst_size);
+    memset(C->labeled, 0, C->inst_size);
+    push_target(C, &sp, func->begin, 0);
+    while (sp > 0) {
+        unsigned pc = C->worklist[--sp];
+        const moz_inst_t *p = C->inst + pc;
+        uint8_t opcode = opcode_base(*p);
+        unsigned next = pc + opcode_size(opcode);
+        int offset = 0;
+        switch (opcode) {
+        case Fail:
+        case Ret:
+        case MemoFail:
+        case OAny:
+        case RAny:
+        case TAbort:
+        case SIsDef:
+        case SDefNum:
+        case SCount:
+            break;
+        case Exit:
+            fprintf(stderr, "mozc: unexpected Exit at %u\n", pc);
+            return 0;
+        case Jump:
+            jump_operand(opcode, &offset);
+            push_target(C, &sp, next + READ(mozaddr_t, p + offset), 1);
+            break;
+        case Call:
+#ifdef MOZVM_USE_NTERM
+            add_func(C, next + READ(mozaddr_t, p + MOZVM_INST_HEADER_SIZE
+                        + sizeof(uint16_t) + sizeof(mozaddr_t)),
+                    READ(uint16_t, p + MOZVM_INST_HEADER_SIZE));
+#else
+            add_func(C, next + READ(mozaddr_t, p + MOZVM_INST_HEADER_SIZE
+                        + sizeof(mozaddr_t)), -1);
+#endif
+            jump_operand(opcode, &offset);
+            push_target(C, &sp, next + READ(mozaddr_t, p + offset), 1);
+            break;
+        default:
+            if (is_table(opcode)) {
+                unsigned ch;
+                for (ch = 0; ch < 256; ch++) {
+                    push_target(C, &sp, next + table_jump(C, p, ch), 1);
+                }
+                break;
+            }
+            if (jump_operand(opcode, &offset)) {
+                push_target(C, &sp, next + READ(mozaddr_t, p + offset), 1);
+            }
+            push_target(C, &sp, next, 0);
+            break;
+        }
+    }
+    return 1;
+}
+
+static void emit_func_name(mozc_t *C, int id)
+{
+    mozc_func_t *f = ARRAY_n(C->funcs, id);
+    fprintf(C->out, "p%d", id);
+    if (f->nterm >= 0) {
+        fputc('_', C->out);
+        const char *s = C->R->C.nterms[f->nterm];
+        for (; *s; s++) {
+            fputc(('a' <= *s && *s <= 'z') || ('A' <= *s && *s <= 'Z')
+                    || ('0' <= *s && *s <= '9') ? *s : '_', C->out);
+        }
+    }
+    else if (id == 0) {
+        fputs("_start", C->out);
+    }
+}
+
+static void emit_string(FILE *out, const char *s, unsigned len)
+{
+    unsigned i;
+    fputc('"', out);
+    for (i = 0; i < len; i++) {
+        uint8_t ch = (uint8_t)s[i];
+        if (ch == '"' || ch == '\\') {
+            fprintf(out, "\\%c", ch);
+        }
+        else if (32 <= ch && ch <= 126 && ch != '?') {
+            fputc(ch, out);
+        }
+        else {
+            fprintf(out, "\\%03o", ch);
+        }
+    }
+    fputc('"', out);
+}
+
+static void emit_constants(mozc_t *C)
+{
+    mozvm_constant_t *K = &C->R->C;
+    unsigned i, j;
+    for (i = 0; i < K->str_size; i++) {
+        fprintf(C->out, "static const char str%u[] = ", i);
+        emit_string(C->out, K->strs[i], pstring_length(K->strs[i]));
+        fprintf(C->out, ";\n");
+    }
+    for (i = 0; i < K->tag_size; i++) {
+        fprintf(C->out, "static const char tag%u[] = ", i);
+        emit_string(C->out, K->tags[i], pstring_length(K->tags[i]));
+        fprintf(C->out, ";\n");
+    }
+    for (i = 0; i < K->table_size; i++) {
+        fprintf(C->out, "static const char tbl%u[] = ", i);
+        emit_string(C->out, K->tables[i], pstring_length(K->tables[i]));
+        fprintf(C->out, ";\n");
+    }
+    for (i = 0; i < K->set_size; i++) {
+        fprintf(C->out, "static const uint8_t set%u[256] = {", i);
+        for (j = 0; j < 256; j++) {
+            fprintf(C->out, "%s%d", j % 32 == 0 ? "\n    " : "",
+                    bitset_get(&K->sets[i], j));
+            if (j != 255) {
+                fputc(',', C->out);
+            }
+        }
+        fprintf(C->out, "\n};\n");
+    }
+    fprintf(C->out, "\n");
+}
+
+#define OUT(...) fprintf(C->out, __VA_ARGS__)
+#define GOTO(TARGET) OUT("goto L%u;", (unsigned)(TARGET))
+
+static void emit_str_match(mozc_t *C, STRING_t id)
+{
+    OUT("memcmp(cur, str%u, %u) == 0", (unsigned)id,
+            pstring_length(C->R->C.strs[id]));
+}
+
+static void emit_inst(mozc_t *C, unsigned pc)
+{
+    const moz_inst_t *p = C->inst + pc;
+    uint8_t opcode = opcode_base(*p);
+    unsigned next = pc + opcode_size(opcode);
+    const moz_inst_t *arg = p + MOZVM_INST_HEADER_SIZE;
+    unsigned ch;
+
+    if (C->labeled[pc]) {
+        OUT("L%u:;\n", pc);
+    }
+    OUT("    /* %-8s */ ", opcode2str(opcode));
+    switch (opcode) {
+    case Nop:
+    case Label:
+        break;
+    case Fail:
+        OUT("goto L_fail;");
+        break;
+    case Alt:
+        OUT("PUSH_FRAME(&&L%u);", next + READ(mozaddr_t, arg));
+        break;
+    case Succ:
+        OUT("POP_FRAME();");
+        break;
+    case Jump:
+        GOTO(next + READ(mozaddr_t, arg));
+        break;
+    case Call: {
+#ifdef MOZVM_USE_NTERM
+        mozaddr_t ret  = READ(mozaddr_t, arg + sizeof(uint16_t));
+        mozaddr_t jump = READ(mozaddr_t, arg + sizeof(uint16_t) + sizeof(mozaddr_t));
+#else
+        mozaddr_t ret  = READ(mozaddr_t, arg);
+        mozaddr_t jump = READ(mozaddr_t, arg + sizeof(mozaddr_t));
+#endif
+        OUT("CALL(");
+        emit_func_name(C, find_func(C, next + jump));
+        OUT("); ");
+        GOTO(next + ret);
+        break;
+    }
+    case Ret:
+        OUT("return cur;");
+        break;
+    case Pos:
+        OUT("*SP++ = (long)cur;");
+        break;
+    case Back:
+        OUT("cur = (const char *)*--SP;");
+        break;
+    case Skip:
+        OUT("SKIP();");
+        break;
+    case Byte:
+        OUT("if ((uint8_t)*cur != %u) goto L_fail; cur++;", READ(uint8_t, arg));
+        break;
+    case NByte:
+        OUT("if ((uint8_t)*cur == %u) goto L_fail;", READ(uint8_t, arg));
+        break;
+    case OByte:
+        OUT("if ((uint8_t)*cur == %u) cur++;", READ(uint8_t, arg));
+        break;
+    case RByte:
+        OUT("while ((uint8_t)*cur == %u) cur++;", READ(uint8_t, arg));
+        break;
+    case Any:
+        OUT("if (cur == c->tail) goto L_fail; cur++;");
+        break;
+    case NAny:
+        OUT("if (cur != c->tail) goto L_fail;");
+        break;
+    case Str:
+        OUT("if (!(");
+        emit_str_match(C, READ(STRING_t, arg));
+        OUT(")) goto L_fail; cur += %u;", pstring_length(C->R->C.strs[READ(STRING_t, arg)]));
+        break;
+    case NStr:
+        OUT("if (");
+        emit_str_match(C, READ(STRING_t, arg));
+        OUT(") goto L_fail;");
+        break;
+    case OStr:
+        OUT("if (");
+        emit_str_match(C, READ(STRING_t, arg));
+        OUT(") cur += %u;", pstring_length(C->R->C.strs[READ(STRING_t, arg)]));
+        break;
+    case RStr:
+        OUT("while (");
+        emit_str_match(C, READ(STRING_t, arg));
+        OUT(") cur += %u;", pstring_length(C->R->C.strs[READ(STRING_t, arg)]));
+        break;
+    case Set:
+        OUT("if (!set%u[(uint8_t)*cur]) goto L_fail; cur++;", READ(BITSET_t, arg));
+        break;
+    case NSet:
+        OUT("if (set%u[(uint8_t)*cur]) goto L_fail;", READ(BITSET_t, arg));
+        break;
+    case OSet:
+        OUT("if (set%u[(uint8_t)*cur]) cur++;", READ(BITSET_t, arg));
+        break;
+    case RSet:
+        OUT("while (set%u[(uint8_t)*cur]) cur++;", READ(BITSET_t, arg));
+        break;
+    case Consume:
+        OUT("cur += %d;", READ(int8_t, arg));
+        break;
+    case First:
+    case TblJump1:
+    case TblJump2:
+    case TblJump3: {
+        int jumps[256], defaultJump, max = 0;
+        unsigned i;
+        for (ch = 0; ch < 256; ch++) {
+            jumps[ch] = table_jump(C, p, ch);
+        }
+        defaultJump = jumps[0];
+        for (ch = 0; ch < 256; ch++) {
+            int n = 0;
+            for (i = 0; i < 256; i++) {
+                n += jumps[i] == jumps[ch];
+            }
+            if (n > max) {
+                max = n;
+                defaultJump = jumps[ch];
+            }
+        }
+        OUT("switch ((uint8_t)*cur) {\n");
+        for (ch = 0; ch < 256; ch++) {
+            if (jumps[ch] != defaultJump) {
+                OUT("    case %u: ", ch);
+                GOTO(next + jumps[ch]);
+                OUT("\n");
+            }
+        }
+        OUT("    default: ");
+        GOTO(next + defaultJump);
+        OUT("\n    }");
+        break;
+    }
+    case Lookup:
+        OUT("LOOKUP(%u, %u, ", READ(uint16_t, arg + 1), READ(uint8_t, arg));
+        GOTO(next + READ(mozaddr_t, arg + 1 + sizeof(uint16_t)));
+        OUT(");");
+        break;
+    case TLookup:
+        OUT("TLOOKUP(%u, %u, tag%u, ", READ(uint16_t, arg + 1 + sizeof(TAG_t)),
+                READ(uint8_t, arg), READ(TAG_t, arg + 1));
+        GOTO(next + READ(mozaddr_t, arg + 1 + sizeof(TAG_t) + sizeof(uint16_t)));
+        OUT(");");
+        break;
+    case Memo:
+        OUT("MEMO(%u, %u, NULL);", READ(uint16_t, arg + 1), READ(uint8_t, arg));
+        break;
+    case TMemo:
+        OUT("MEMO(%u, %u, ast_get_last_linked_node(c->ast));",
+                READ(uint16_t, arg + 1), READ(uint8_t, arg));
+        break;
+    case MemoFail:
+        OUT("memo_fail(c->memo, cur, %u, MEMO_REACH_UNKNOWN); goto L_fail;", READ(uint16_t, arg + 1));
+        break;
+    case TPush:
+        OUT("ast_log_push(c->ast);");
+        break;
+    case TPop:
+        OUT("ast_log_pop(c->ast, tag%u);", READ(TAG_t, arg));
+        break;
+    case TLeftFold:
+        OUT("ast_log_swap(c->ast, cur + %u, tag%u);",
+                READ(uint8_t, arg), READ(TAG_t, arg + 1));
+        break;
+    case TNew:
+        OUT("ast_log_new(c->ast, cur + %u);", READ(uint8_t, arg));
+        break;
+    case TCapture:
+        OUT("ast_log_capture(c->ast, cur + %u);", READ(uint8_t, arg));
+        break;
+    case TTag:
+        OUT("ast_log_tag(c->ast, tag%u);", READ(TAG_t, arg));
+        break;
+    case TReplace:
+        OUT("ast_log_replace(c->ast, str%u);", READ(STRING_t, arg));
+        break;
+    case TStart:
+        OUT("*SP++ = ast_save_tx(c->ast);");
+        break;
+    case TCommit:
+        OUT("SP--; ast_commit_tx(c->ast, tag%u, *SP);", READ(TAG_t, arg));
+        break;
+    case SOpen:
+        OUT("*SP++ = symtable_savepoint(c->tbl);");
+        break;
+    case SClose:
+        OUT("SP--; symtable_rollback(c->tbl, *SP);");
+        break;
+    case SMask:
+        OUT("*SP++ = symtable_savepoint(c->tbl); symtable_add_symbol_mask(c->tbl, tbl%u);",
+                READ(TAG_t, arg));
+        break;
+    case SDef:
+        OUT("SDEF(tbl%u);", READ(TAG_t, arg));
+        break;
+    case SExists:
+        OUT("if (!symtable_has_symbol(c->tbl, tbl%u)) goto L_fail;", READ(TAG_t, arg));
+        break;
+    case SMatch:
+        OUT("SMATCH(tbl%u);", READ(TAG_t, arg));
+        break;
+    case SIs:
+        OUT("SIS(tbl%u);", READ(TAG_t, arg));
+        break;
+    case SIsa:
+        OUT("SISA(tbl%u);", READ(TAG_t, arg));
+        break;
+    default:
+        /* not implemented in vm either */
+        OUT("abort();");
+        break;
+    }
+    OUT("\n");
+}
+
+static int emit_func(mozc_t *C, int id)
+{
+    unsigned pc, has_alt = 0;
+    unsigned begin = ARRAY_n(C->funcs, id)->begin;
+    if (!mozc_scan(C, ARRAY_n(C->funcs, id))) {
+        return 0;
+    }
+    C->labeled[begin] = 1;
+    for (pc = 0; pc < C->inst_size; pc++) {
+        if (C->reachable[pc] && C->inst[pc] == Alt) {
+            has_alt = 1;
+        }
+    }
+    OUT("static const char *");
+    emit_func_name(C, id);
+    OUT("(mozc_context_t *c, const char *cur, long *SP)\n{\n");
+    OUT("    long *FP = NULL;\n");
+    OUT("    (void)FP;\n");
+    OUT("    CHECK_STACK_OVERFLOW();\n");
+    OUT("    goto L%u;\n", begin);
+    /* reachable insts are emitted in bytecode order, so fallthrough is kept */
+    for (pc = 0; pc < C->inst_size; pc++) {
+        if (C->reachable[pc]) {
+            emit_inst(C, pc);
+        }
+    }
+    OUT("L_fail:\n");
+    if (has_alt) {
+        OUT("    FAIL();\n");
+    }
+    else {
+        OUT("    return NULL;\n");
+    }
+    OUT("}\n\n");
+    return 1;
+}
+
+static const char *mozc_prelude =
+"#include <stdint.h>\n"
+"#include <stdlib.h>\n"
+"#include <string.h>\n"
+"#include \"libnez.h\"\n"
+"#include \"token.h\"\n"
+"#ifdef MOZVM_USE_MMAP_STACK\n"
+"#include <sys/mman.h>\n"
+"#endif\n"
+"\n"
+"typedef struct mozc_context_t {\n"
+"    AstMachine *ast;\n"
+"    symtable_t *tbl;\n"
+"    memo_t *memo;\n"
+"    const char *head;\n"
+"    const char *tail;\n"
+"    long *stack_end;\n"
+"    const char *native_limit;\n"
+"} mozc_context_t;\n"
+"\n"
+"/* returned by pN() when the parse runs out of stack; never a valid cur */\n"
+"#define MOZC_STACK_OVERFLOW ((const char *)1)\n"
+"/* checked on function entry and on each frame, like Call and Alt in moz vm */\n"
+"#define CHECK_STACK_OVERFLOW() do { \\\n"
+"    if (SP + MOZ_STACK_REDZONE > c->stack_end || \\\n"
+"            (const char *)__builtin_frame_address(0) < c->native_limit) { \\\n"
+"        return MOZC_STACK_OVERFLOW; \\\n"
+"    } \\\n"
+"} while (0)\n"
+"\n"
+"/* frame layout is same as moz vm: [FP, POS, NEXT, AST, SYMTBL] */\n"
+"#define PUSH_FRAME(NEXT) do { \\\n"
+"    CHECK_STACK_OVERFLOW(); \\\n"
+"    SP[0] = (long)FP; SP[1] = (long)cur; SP[2] = (long)(NEXT); \\\n"
+"    SP[3] = ast_save_tx(c->ast); SP[4] = symtable_savepoint(c->tbl); \\\n"
+"    FP = SP; SP += 5; \\\n"
+"} while (0)\n"
+"#define POP_FRAME() do { SP = FP; FP = (long *)FP[0]; } while (0)\n"
+"#define FAIL() do { \\\n"
+"    const char *pos_; void *next_; long tx_, saved_; \\\n"
+"    if (FP == NULL) { return NULL; } \\\n"
+"    pos_ = (const char *)FP[1]; next_ = (void *)FP[2]; \\\n"
+"    tx_ = FP[3]; saved_ = FP[4]; \\\n"
+"    POP_FRAME(); \\\n"
+"    if (pos_ < cur) { \\\n"
+"        c->head = (c->head < cur) ? cur : c->head; \\\n"
+"        cur = pos_; \\\n"
+"    } \\\n"
+"    ast_rollback_tx(c->ast, tx_); \\\n"
+"    symtable_rollback(c->tbl, saved_); \\\n"
+"    goto *next_; \\\n"
+"} while (0)\n"
+"#define CALL(F) do { \\\n"
+"    const char *r_ = F(c, cur, SP); \\\n"
+"    if (r_ == NULL) { goto L_fail; } \\\n"
+"    if (r_ == MOZC_STACK_OVERFLOW) { return r_; } \\\n"
+"    cur = r_; \\\n"
+"} while (0)\n"
+"#define SKIP() do { \\\n"
+"    if ((const char *)FP[1] == cur) { goto L_fail; } \\\n"
+"    FP[1] = (long)cur; \\\n"
+"    FP[3] = ast_save_tx(c->ast); \\\n"
+"    FP[4] = symtable_savepoint(c->tbl); \\\n"
+"} while (0)\n"
+"#define LOOKUP(ID, STATE, SKIP_) do { \\\n"
+"    MemoEntry_t *e_ = memo_get(c->memo, cur, ID, STATE); \\\n"
+"    if (e_) { \\\n"
+"        if (e_->consumed == MEMO_ENTRY_FAILED) { goto L_fail; } \\\n"
+"        cur += e_->consumed; \\\n"
+"        SKIP_ \\\n"
+"    } \\\n"
+"} while (0)\n"
+"#define TLOOKUP(ID, STATE, TAG, SKIP_) do { \\\n"
+"    MemoEntry_t *e_ = memo_get(c->memo, cur, ID, STATE); \\\n"
+"    if (e_) { \\\n"
+"        if (e_->consumed == MEMO_ENTRY_FAILED) { goto L_fail; } \\\n"
+"        cur += e_->consumed; \\\n"
+"        ast_log_link(c->ast, TAG, memo_entry_result(c->memo, e_)); \\\n"
+"        SKIP_ \\\n"
+"    } \\\n"
+"} while (0)\n"
+"#define MEMO(ID, STATE, NODE) do { \\\n"
+"    const char *pos_ = (const char *)FP[1]; \\\n"
+"    POP_FRAME(); \\\n"
+"    memo_set(c->memo, pos_, ID, NODE, cur - pos_, STATE, MEMO_REACH_UNKNOWN); \\\n"
+"} while (0)\n"
+"#define SDEF(TBL) do { \\\n"
+"    token_t t_; \\\n"
+"    SP--; \\\n"
+"    token_init(&t_, (const char *)*SP, cur); \\\n"
+"    symtable_add_symbol(c->tbl, TBL, &t_); \\\n"
+"} while (0)\n"
+"#define SMATCH(TBL) do { \\\n"
+"    token_t t_; \\\n"
+"    if (!symtable_get_symbol(c->tbl, TBL, &t_) || !token_equal_string(&t_, cur)) { goto L_fail; } \\\n"
+"    cur += token_length(&t_); \\\n"
+"} while (0)\n"
+"#define SIS(TBL) do { \\\n"
+"    token_t t_, captured_; \\\n"
+"    SP--; \\\n"
+"    if (!symtable_get_symbol(c->tbl, TBL, &t_)) { goto L_fail; } \\\n"
+"    token_init(&captured_, (const char *)*SP, cur); \\\n"
+"    if (!token_equal(&t_, &captured_)) { goto L_fail; } \\\n"
+"    cur += token_length(&t_); \\\n"
+"} while (0)\n"
+"#define SISA(TBL) do { \\\n"
+"    token_t captured_; \\\n"
+"    SP--; \\\n"
+"    token_init(&captured_, (const char *)*SP, cur); \\\n"
+"    if (!symtable_contains(c->tbl, TBL, &captured_)) { goto L_fail; } \\\n"
+"    cur += token_length(&captured_); \\\n"
+"} while (0)\n"
+"\n";
+
+static void emit_entry(mozc_t *C)
+{
+    OUT("/* parse input[0..length). returns 0 on success and stores parsed ast\n");
+    OUT(" * to *node, 1 on a parse error and 2 (MOZVM_PARSE_STACK_OVERFLOW) when\n");
+    OUT(" * the input nests too deep. NodeManager_init() must be called beforehand. */\n");
+    OUT("int %s_parse(const char *input, size_t length, Node **node)\n{\n", C->prefix);
+    OUT("    mozc_context_t ctx, *c = &ctx;\n");
+    OUT("#ifdef MOZVM_USE_MMAP_STACK\n");
+    OUT("    size_t size = sizeof(long) * MOZ_STACK_RESERVE_SIZE;\n");
+    OUT("    long *stack = (long *)mmap(NULL, size, PROT_READ | PROT_WRITE,\n");
+    OUT("            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);\n");
+    OUT("#else\n");
+    OUT("    size_t size = sizeof(long) * MOZ_DEFAULT_STACK_SIZE;\n");
+    OUT("    long *stack = (long *)malloc(size);\n");
+    OUT("#endif\n");
+    OUT("    const char *end;\n");
+    OUT("    c->stack_end = stack + size / sizeof(long);\n");
+    OUT("    c->native_limit = (const char *)__builtin_frame_address(0) - MOZC_NATIVE_STACK_SIZE;\n");
+    OUT("    c->ast  = AstMachine_init(MOZ_AST_MACHINE_DEFAULT_LOG_SIZE, input);\n");
+    OUT("    c->tbl  = symtable_init();\n");
+    OUT("    c->memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, %u, MEMO_TYPE_DEFAULT);\n", C->R->C.memo_size);
+    OUT("    memo_set_base(c->memo, input);\n");
+    OUT("    memo_reserve(c->memo, length);\n");
+    OUT("    c->head = input;\n");
+    OUT("    c->tail = input + length;\n");
+    OUT("    end = ");
+    emit_func_name(C, 0);
+    OUT("(c, input, stack);\n");
+    OUT("    if (end != NULL && end != MOZC_STACK_OVERFLOW && node != NULL) {\n");
+    OUT("        *node = ast_get_parsed_node(c->ast);\n");
+    OUT("    }\n");
+    OUT("    AstMachine_dispose(c->ast);\n");
+    OUT("    symtable_dispose(c->tbl);\n");
+    OUT("    memo_dispose(c->memo);\n");
+    OUT("#ifdef MOZVM_USE_MMAP_STACK\n");
+    OUT("    munmap(stack, size);\n");
+    OUT("#else\n");
+    OUT("    free(stack);\n");
+    OUT("#endif\n");
+    OUT("    if (end == MOZC_STACK_OVERFLOW) {\n");
+    OUT("        return 2;\n");
+    OUT("    }\n");
+    OUT("    return end == NULL;\n");
+    OUT("}\n");
+}
+
+static int mozc_compile(mozc_t *C, const char *file)
+{
+    unsigned i;
+    OUT("/* generated by mozc from %s. do not edit. */\n", file);
+    fputs(mozc_prelude, C->out);
+    emit_constants(C);
+
+    /* skip Exit stubs at the head of bytecode (see moz_runtime_parse_init) */
+    add_func(C, 2 * (MOZVM_INST_HEADER_SIZE + 1), -1);
+
+    /* functions are discovered while scanning callers */
+    for (i = 0; i < ARRAY_size(C->funcs); i++) {
+        OUT("static const char *");
+        emit_func_name(C, i);
+        OUT("(mozc_context_t *c, const char *cur, long *SP);\n");
+        if (!mozc_scan(C, ARRAY_n(C->funcs, i))) {
+            return 0;
+        }
+    }
+    OUT("\n");
+    for (i = 0; i < ARRAY_size(C->funcs); i++) {
+        if (!emit_func(C, i)) {
+            return 0;
+        }
+    }
+    emit_entry(C);
+    return 1;
+}
+
+int main(int argc, char *const argv[])
+{
+    mozvm_loader_t L = {};
+    mozc_t C = {};
+    const char *syntax_file = NULL;
+    const char *output_file = NULL;
+    const char *profile_file = NULL;
+    int opt, ok;
+
+    C.prefix = "moz";
+    while ((opt = getopt(argc, argv, "p:o:n:O:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            syntax_file = optarg;
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        case 'n':
+            C.prefix = optarg;
+            break;
+        case 'O':
+            profile_file = optarg;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (syntax_file == NULL) {
+        fprintf(stderr, "error: please specify bytecode file\n");
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (profile_file && !mozvm_loader_load_profile(&L, profile_file)) {
+        fprintf(stderr, "error: failed to load profile='%s'\n", profile_file);
+        exit(EXIT_FAILURE);
+    }
+    C.inst = mozvm_loader_load_file(&L, syntax_file);
+    C.L = &L;
+    C.R = L.R;
+    C.inst_size = ARRAY_size(L.buf);
+    C.out = stdout;
+    if (output_file && (C.out = fopen(output_file, "w")) == NULL) {
+        fprintf(stderr, "error: failed to open '%s'\n", output_file);
+        exit(EXIT_FAILURE);
+    }
+    C.reachable = (uint8_t *)VM_CALLOC(1, C.inst_size);
+    C.labeled   = (uint8_t *)VM_CALLOC(1, C.inst_size);
+    C.worklist  = (unsigned *)VM_CALLOC(1, sizeof(unsigned) * C.inst_size);
+    ARRAY_init(mozc_func_t, &C.funcs, 4);
+
+    ok = mozc_compile(&C, syntax_file);
+
+    ARRAY_dispose(mozc_func_t, &C.funcs);
+    VM_FREE(C.reachable);
+    VM_FREE(C.labeled);
+    VM_FREE(C.worklist);
+    if (C.out != stdout) {
+        fclose(C.out);
+    }
+    moz_runtime_dispose(L.R);
+    mozvm_loader_dispose(&L);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
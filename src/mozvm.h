@@ -10,6 +10,7 @@
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,18 +20,46 @@ typedef uint8_t moz_inst_t;
 struct moz_runtime_t;
 
 #ifdef MOZVM_ENABLE_JIT
-typedef unsigned (*moz_jit_func_t)(struct moz_runtime_t *, const char *);
+/* returns the position after the nterm, NULL on failure or
+ * MOZVM_JIT_STACK_OVERFLOW */
+typedef const char *(*moz_jit_func_t)(struct moz_runtime_t *, const char *, long *, long *);
 
+enum mozvm_jit_state {
+    MOZVM_JIT_STATE_NONE = 0,
+    MOZVM_JIT_STATE_QUEUED,
+    MOZVM_JIT_STATE_COMPILED,
+    MOZVM_JIT_STATE_FAILED
+};
+
+/* an nterm of a program and the code compiled for it */
 typedef struct mozvm_nterm_entry_t {
     moz_inst_t *begin;
     moz_inst_t *end;
-    unsigned call_counter;
+    unsigned state;
     moz_jit_func_t compiled_code;
 } mozvm_nterm_entry_t;
 
+/* how often a runtime ran an nterm in the interpreter */
+typedef struct mozvm_jit_counter_t {
+    unsigned call;
+    unsigned loop;
+} mozvm_jit_counter_t;
+
 typedef void jit_context_t;
 #endif
 
+/*
+ * What a failure into an Alt frame does once it resumes at the fail
+ * target, as far as the ast log is concerned (see mozvm_loader_fail_kind()).
+ * AST_MODE_EVENT fires the events of the logs that no frame can roll back,
+ * and so ignores the frames that never roll back on their own.
+ */
+enum mozvm_fail_kind {
+    MOZVM_FAIL_RESUME,  /* parses on from the target */
+    MOZVM_FAIL_RETHROW, /* MemoFail or Fail: fails into the frame below */
+    MOZVM_FAIL_COMMIT   /* Succ after a repetition: pops the frame below */
+};
+
 typedef struct mozvm_constant_t {
     bitset_t *sets;
     const char **tags;
@@ -43,6 +72,8 @@ typedef struct mozvm_constant_t {
     jump_table3_t *jumps3;
 #endif
     const char **nterms;
+    moz_inst_t **nterm_code; /* first instruction of each nterm */
+    uint8_t *fail_kind;      /* MOZVM_FAIL_* of each Alt target, by offset */
 
     uint16_t set_size;
     uint16_t str_size;
@@ -54,29 +85,91 @@ typedef struct mozvm_constant_t {
     unsigned memo_size;
     unsigned input_size;
 #ifdef MOZVM_PROFILE_INST
+    /* execution count per bytecode offset. Shared by every runtime on the
+     * program and not atomic: profile builds parse on one thread only */
     long *profile;
 #endif
 } mozvm_constant_t;
 
+/*
+ * A loaded grammar: the instructions and the constant pool they refer to.
+ * Nothing in it is written once the loader is done, so any number of
+ * runtimes, in any number of threads, can run the same program. It is
+ * freed by the last moz_program_release().
+ */
+typedef struct moz_program_t {
+    long refc;
+    moz_inst_t *inst; /* entry point, as returned by mozvm_loader_load_file() */
+    void *code;       /* instruction buffer */
+#ifdef MOZVM_ENABLE_JIT
+    /* code compiled by any runtime is used by every runtime of the program */
+    mozvm_nterm_entry_t *nterm_entry;
+    jit_context_t *jit_context;
+#endif
+    mozvm_constant_t C;
+} moz_program_t;
+
+#ifdef MOZVM_USE_SPECULATIVE_PARSE
+/* the result of an nterm at pos: the position it ends at and its ast log */
+typedef struct moz_splice_entry_t {
+    mozpos_t pos;
+    mozpos_t end;
+    const AstLog *logs;
+    unsigned nlog;
+} moz_splice_entry_t;
+
+typedef struct moz_splice_t {
+    const moz_inst_t *code;       /* C.nterm_code[] of the nterm */
+    moz_splice_entry_t *entries;  /* sorted by pos */
+    unsigned size;
+} moz_splice_t;
+#endif
+
 typedef struct moz_runtime_t {
     AstMachine *ast;
+    moz_program_t *program;
     symtable_t *table;
     memo_t *memo;
+    memo_type_t memo_type;
     mozpos_t head;
     const char *tail;
     const char *input;
     long *stack;
     long *fp;
+    long *stack_;
+    long *stack_end;
+    /* position the last parse reached Exit at */
+    mozpos_t stop;
+#ifdef MOZVM_USE_SPECULATIVE_PARSE
+    moz_splice_t *splice;
+#endif
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+    /* head as each memoized call in progress found it; NULL unless the
+     * runtime is incremental */
+    mozpos_t *reach;
+    unsigned reach_top;
+    unsigned reach_size;
+    /* bytes an instruction may look at past the position it stands at */
+    unsigned lookahead;
+#endif
+#ifdef MOZVM_MEMO_USE_SLIDING_WINDOW
+    /* position of the last memo sweep */
+    mozpos_t memo_swept;
+#endif
 
-#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
+#ifdef MOZVM_USE_MEMO_POINTS
     MemoPoint *memo_points;
 #endif
 #ifdef MOZVM_ENABLE_JIT
+    /* program->nterm_entry, or the loader's until there is a program */
     mozvm_nterm_entry_t *nterm_entry;
-    jit_context_t *jit_context;
+    mozvm_jit_counter_t *jit_counter;
+    /* compiled code does not grow the C stack of the parse below it */
+    const char *jit_stack_limit;
+    /* run hot nterms compiled; off unless moz_runtime_enable_jit() */
+    int jit;
 #endif
     mozvm_constant_t C;
-    long stack_[1];
 } moz_runtime_t;
 
 #if MOZVM_SMALL_STRING_INST
@@ -114,8 +207,28 @@ typedef int *JMPTBL_t;
 #define JMPTBL_GET_IMPL(runtime, ID) (ID)
 #endif
 
-moz_runtime_t *moz_runtime_init(unsigned memo_size, unsigned nterm_size);
+moz_runtime_t *moz_runtime_init(unsigned memo_size, unsigned nterm_size, memo_type_t memo_type);
 void moz_runtime_dispose(moz_runtime_t *r);
+/*
+ * Runs p on r, which must come from moz_runtime_init(p->C.memo_size,
+ * p->C.nterm_size, ...), and holds a reference to p until r is disposed.
+ * r gets its own copy of p->C so that the VM reads it without going
+ * through p. The first parse starts at moz_runtime_parse_init(r, str,
+ * p->inst).
+ */
+void moz_runtime_attach(moz_runtime_t *r, moz_program_t *p);
+/* makes a program of the constant pool the loader built in r */
+moz_program_t *moz_program_init(moz_runtime_t *r, moz_inst_t *inst, void *code);
+moz_program_t *moz_program_retain(moz_program_t *p);
+void moz_program_release(moz_program_t *p);
+#ifdef MOZVM_ENABLE_JIT
+/*
+ * Let r compile the nterms it calls often and run them compiled. The JIT
+ * costs ~0.1s of LLVM time and has no on-stack replacement, so it only
+ * pays off on large inputs parsed more than once; it is off by default.
+ */
+void moz_runtime_enable_jit(moz_runtime_t *r, int enable);
+#endif
 void moz_runtime_reset1(moz_runtime_t *r);
 void moz_runtime_reset2(moz_runtime_t *r);
 
@@ -127,12 +240,130 @@ static inline void moz_runtime_set_source(moz_runtime_t *r, const char *str, con
     r->head = 0;
 #endif
     r->tail = end;
+#ifdef MOZVM_MEMO_USE_SLIDING_WINDOW
+    r->memo_swept = r->head;
+#endif
+    memo_set_base(r->memo, r->head);
+    memo_reserve(r->memo, end - str);
     AstMachine_setSource(r->ast, str);
 }
 
+/*
+ * Make r ready for the next parse while keeping every allocation: the ast
+ * log and the symbol table are truncated and the memo table moves on to a
+ * new generation instead of being cleared. Unlike reset1/reset2 it needs
+ * no NodeManager_reset() in between, and it costs O(1) plus the ast log of
+ * the previous parse. moz_runtime_set_source() must follow as usual.
+ */
+void moz_runtime_reuse(moz_runtime_t *r);
+/*
+ * moz_runtime_reuse() and set_source for the next of many short inputs
+ * parsed back to back (the records of -r), without resizing the memo
+ * table. Call moz_runtime_set_source() once beforehand with the whole
+ * batch to size it.
+ */
+void moz_runtime_set_record(moz_runtime_t *r, const char *str, const char *end);
+
 void moz_runtime_print_stats(moz_runtime_t *r);
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+/* one line per memo point, suitable for feeding back into the loader */
+void moz_runtime_print_memo_points(moz_runtime_t *r, FILE *fp);
+#endif
 moz_inst_t *moz_runtime_parse_init(moz_runtime_t *, const char *, moz_inst_t *);
+/* returns 0 on success, 1 on parse error */
+#define MOZVM_PARSE_STACK_OVERFLOW 2
+/* returned by moz_runtime_parse_stream() once the stream is drained */
+#define MOZVM_PARSE_END_OF_STREAM  3
 long moz_runtime_parse(moz_runtime_t *r, const char *str, const moz_inst_t *inst);
+/*
+ * Like moz_runtime_parse_init(), but the parse starts at nterm instead of
+ * the start rule, so that a fragment such as a single value can be parsed
+ * on its own. It ends in the Exit instructions at head, which must be
+ * what moz_runtime_parse_init() would take, once nterm returns or fails.
+ */
+moz_inst_t *moz_runtime_parse_init_nterm(moz_runtime_t *r, const char *str,
+        moz_inst_t *head, unsigned nterm);
+/* index of the nterm called name in r->C.nterms, -1 if there is none */
+int moz_runtime_find_nterm(moz_runtime_t *r, const char *name);
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+/*
+ * For an editor that parses the same text again after every change.
+ * moz_runtime_incremental() gives r a memo table that keeps the entries of
+ * every parse (MEMO_TYPE_RETAIN) along with how far each of them looked;
+ * call it once before the first parse, which is done as usual.
+ * Once the text at str has been edited in place, replacing removed bytes
+ * at offset with inserted others, moz_runtime_reparse() drops the entries
+ * the edit may have changed, moves those behind it, and parses from head
+ * again; end is the new end of the text, followed by the usual NUL
+ * padding. Subtrees the edit did not touch come back from the memo table,
+ * so a small edit costs about the part of the grammar around it. The JIT
+ * does not keep track of how far it looked, so an incremental runtime
+ * stays in the interpreter even if moz_runtime_enable_jit() was called.
+ */
+void moz_runtime_incremental(moz_runtime_t *r);
+long moz_runtime_reparse(moz_runtime_t *r, const char *str, const char *end,
+        moz_inst_t *head, size_t offset, size_t removed, size_t inserted);
+#endif
+#ifdef MOZVM_USE_SPECULATIVE_PARSE
+/*
+ * Experimental parallel version of moz_runtime_parse() for documents made
+ * of a long list of elements, such as a huge JSON array. nworker threads,
+ * each with a runtime attached to r->program, cut [str, r->tail) into
+ * parts and parse nterm on their own wherever it may start, that is after
+ * each sep byte and the blanks following it. The parse on r then takes
+ * the result of any Call to nterm at one of those positions from there
+ * instead of running it. Guesses that were wrong are simply never used,
+ * so the tree is the one moz_runtime_parse() builds, provided that what
+ * nterm matches at a position does not depend on how it got there (no
+ * symbol tables, no left folding into the caller's node). Calls made
+ * from code compiled by the JIT are not spliced.
+ */
+long moz_runtime_parse_parallel(moz_runtime_t *r, const char *str,
+        const moz_inst_t *inst, unsigned nterm, int sep, unsigned nworker);
+#endif
+
+/*
+ * Input read incrementally from a file descriptor (a pipe, a socket or
+ * stdin). buf[begin, size) holds the bytes that have not been parsed yet
+ * and is always followed by MOZ_STREAM_PADDING NUL bytes.
+ */
+typedef struct moz_stream_t {
+    char *buf;
+    size_t begin;
+    size_t size;
+    size_t capacity;
+    size_t offset; /* stream offset of buf[0] */
+    int fd;
+    int eof;
+    int start; /* nterm each document starts at, -1 for the start rule */
+} moz_stream_t;
+
+void moz_stream_init(moz_stream_t *s, int fd);
+void moz_stream_dispose(moz_stream_t *s);
+/* read at least `want` more bytes unless the stream ends first.
+ * returns 0 if nothing could be read */
+int moz_stream_fill(moz_stream_t *s, size_t want);
+
+/*
+ * Parse the next document of a stream with the start rule at `inst` (or
+ * s->start, see moz_runtime_parse_init_nterm()) and store its ast to
+ * *node. Whitespace (space, tab, CR, LF) between documents is skipped,
+ * so NDJSON and concatenated documents both work. The rule must match
+ * one document and stop there; one that anchors to the end of the input
+ * (!.) fails on any stream longer than a single document. When the
+ * parser gets close to the end of the buffered bytes it cannot tell a
+ * complete document from a truncated one, so it reads more and parses
+ * the document again from its start (the buffer doubles each time, so
+ * this stays linear). The VM cannot suspend in the middle of a parse, so
+ * the whole current document stays buffered: bytes are released only
+ * once their document is parsed, and memory is bounded by the largest
+ * document rather than by how far the parser may backtrack. *node
+ * points into the stream buffer and must be released before the next
+ * call. Returns 0 on success, 1 on parse error,
+ * MOZVM_PARSE_STACK_OVERFLOW or MOZVM_PARSE_END_OF_STREAM.
+ */
+long moz_runtime_parse_stream(moz_runtime_t *r, moz_stream_t *s,
+        moz_inst_t *inst, Node **node);
 
 #ifdef __cplusplus
 }
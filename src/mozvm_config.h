@@ -6,6 +6,15 @@ extern "C" {
 #endif
 
 /* [core] */
+/*
+ * Storage class of the state that is not owned by a runtime: the node pool
+ * (node.c) and the profile counters. Keeping it per thread lets each thread
+ * parse with its own moz_runtime_t without locking. The TLS model is left
+ * to the compiler: libnez may be dlopen'ed (e.g. by FFI bindings), where
+ * initial-exec can fail to find room in the static TLS block, and
+ * executables and PIEs get the cheap local-exec model anyway.
+ */
+#define MOZVM_THREAD_LOCAL __thread
 
 /* [profile] */
 // #ifndef MOZVM_PROFILE
@@ -24,16 +33,60 @@ extern "C" {
 
 // AstMachine
 #define MOZ_AST_MACHINE_DEFAULT_LOG_SIZE 128
+/* how many logs AST_MODE_EVENT gathers before it fires their events */
+#define MOZ_AST_FLUSH_INTERVAL 4096
 
 // Memo
 #define MOZ_MEMO_DEFAULT_WINDOW_SIZE 32
+#define MOZVM_MEMO_USE_ADAPTIVE_WINDOW 1
+#define MOZ_MEMO_MIN_WINDOW_SIZE 4
+#define MOZ_MEMO_MAX_WINDOW_SIZE 1024
+/* number of memo_set calls between two adaptive checkpoints (2^n) */
+#define MOZ_MEMO_ADAPT_INTERVAL (1 << 16)
+/* drop memo entries behind the oldest Alt frame the parser can fail back to */
+#define MOZVM_MEMO_USE_SLIDING_WINDOW 1
+/* input bytes consumed between two sweeps */
+#define MOZ_MEMO_SWEEP_INTERVAL (1 << 20)
 // #define MOZVM_MEMO_TYPE_NULL    1
 // #define MOZVM_MEMO_TYPE_HASH    1
 #define MOZVM_MEMO_TYPE_ELASTIC 1
 // #define MOZVM_USE_DYNAMIC_DEACTIVATION 1
+/* count lookups/hits per memo point and switch off the ones that never pay */
+#define MOZVM_MEMO_USE_POINT_PROFILE 1
+/* lookups between two profitability checks of a memo point (2^n) */
+#define MOZ_MEMO_POINT_PROBATION (1 << 12)
+/* a memo point must save one byte of parsing per this many lookups */
+#define MOZ_MEMO_POINT_PAYOFF 4
+#if defined(MOZVM_USE_DYNAMIC_DEACTIVATION) || defined(MOZVM_MEMO_USE_POINT_PROFILE)
+#define MOZVM_USE_MEMO_POINTS 1
+#endif
 
 // Runtime
 #define MOZ_DEFAULT_STACK_SIZE  (1024)
+#define MOZVM_USE_MMAP_STACK    1
+/* virtual stack reserved per runtime (in longs); pages are committed on use */
+#define MOZ_STACK_RESERVE_SIZE  (64 * 1024 * 1024)
+/* free slots kept below the stack limit for pushes between overflow checks */
+#define MOZ_STACK_REDZONE       (64)
+/* C stack that a parser generated by mozc may use for its recursion */
+#define MOZC_NATIVE_STACK_SIZE  (4 * 1024 * 1024)
+/* moz_runtime_parse_parallel(): Call splices in the results of one nterm
+ * that other threads computed ahead of time (experimental) */
+#define MOZVM_USE_SPECULATIVE_PARSE 1
+/* smallest part of the input given to a speculating thread */
+#define MOZ_SPECULATION_MIN_CHUNK (256 * 1024)
+/* moz_runtime_reparse(): keep the memo table across parses and parse again
+ * only what an edit of the input may have changed */
+#define MOZVM_USE_INCREMENTAL_PARSE 1
+
+// Input
+/* map input files read-only instead of reading them into the heap */
+#define MOZVM_USE_MMAP_INPUT    1
+/* minimum number of bytes moz_stream_fill() asks read(2) for */
+#define MOZ_STREAM_CHUNK_SIZE   (64 * 1024)
+/* a streamed document counts as complete only if the parser stayed this
+ * many bytes away from the end of the buffered input */
+#define MOZ_STREAM_LOOKAHEAD    32
 
 // jump table
 #define MOZ_JMPTABLE_SIZE 256
@@ -54,16 +107,35 @@ extern "C" {
 #define MOZVM_SMALL_BITSET_INST 1
 #define MOZVM_SMALL_JMPTBL_INST 1
 #define MOZVM_USE_JMPTBL 1
+#define MOZVM_USE_SUPERINST 1
+#define MOZVM_USE_TAILCALL 1
 // #define MOZVM_USE_INT16_ADDR 1
 // #define MOZVM_DEBUG_NTERM       1
 // #define MOZVM_ENABLE_JIT       1
-#define MOZVM_JIT_COUNTER_THRESHOLD 1
+/* an nterm is compiled once it was called this often; there is no on-stack
+ * replacement, so a loop already running in the interpreter stays there,
+ * and compiling a grammar takes ~0.1s of LLVM time. The JIT pays off on
+ * large inputs parsed more than once only, so a runtime uses it only
+ * after moz_runtime_enable_jit() (moz -J) */
+#define MOZVM_JIT_CALL_THRESHOLD 256
+#define MOZVM_JIT_LOOP_THRESHOLD 4096
+#define MOZVM_JIT_USE_BACKGROUND_COMPILE 1
+/* compiled nterms call each other on the C stack; this much of it is left
+ * to the C functions they call */
+#define MOZ_JIT_STACK_MARGIN (256 * 1024)
 #define MOZVM_USE_SSE4_2        1
 // #define MOZVM_USE_SWITCH_CASE_DISPATCH 1
-#define MOZVM_USE_INDIRECT_THREADING   1
 // #define MOZVM_USE_DIRECT_THREADING     1
+#if !defined(MOZVM_USE_SWITCH_CASE_DISPATCH) && !defined(MOZVM_USE_DIRECT_THREADING)
+#define MOZVM_USE_INDIRECT_THREADING   1
+#endif
 // #define MOZVM_EMIT_OP_LABEL 1
 
+#if defined(MOZVM_USE_DIRECT_THREADING) && defined(MOZVM_ENABLE_JIT)
+/* jit and mozc decode 1-byte opcodes */
+#undef MOZVM_ENABLE_JIT
+#endif
+
 #if defined(MOZVM_DEBUG_NTERM) || defined(MOZVM_ENABLE_JIT)
 #define MOZVM_USE_NTERM 1
 #endif
@@ -88,7 +160,7 @@ typedef unsigned long mozpos_t;
 #endif
 
 #ifdef MOZVM_PROFILE
-#define MOZVM_PROFILE_DECL(X) unsigned long long _PROFILE_##X = 0;
+#define MOZVM_PROFILE_DECL(X) MOZVM_THREAD_LOCAL unsigned long long _PROFILE_##X = 0;
 #define MOZVM_PROFILE_INC(X)  (_PROFILE_##X)++
 #define MOZVM_PROFILE_DEC(X)  (_PROFILE_##X)--
 #define MOZVM_PROFILE_INC_N(X, N)  (_PROFILE_##X) += (N)
@@ -32,6 +32,7 @@ Node *Node_new(const char *tag, const char *str, unsigned len, unsigned elm_size
     o->tag = tag;
     o->pos = str;
     o->len = len;
+    o->moved = 0;
     o->value = value;
     o->entry.raw.size = elm_size;
     if (elm_size > MOZVM_SMALL_ARRAY_LIMIT) {
@@ -132,6 +133,37 @@ void Node_free(Node *o)
     VM_FREE(o);
 }
 
+/* numbers the calls to Node_relocate(); 0 is never used */
+static MOZVM_THREAD_LOCAL unsigned relocation = 0;
+
+void Node_relocate(Node **roots, unsigned n, long delta)
+{
+    ARRAY(NodePtr) stack;
+    unsigned i, mark = ++relocation;
+
+    if (mark == 0) {
+        mark = ++relocation;
+    }
+    ARRAY_init(NodePtr, &stack, n + 1);
+    for (i = 0; i < n; i++) {
+        ARRAY_add(NodePtr, &stack, roots[i]);
+    }
+    while (ARRAY_size(stack) > 0) {
+        Node *o = *ARRAY_last(stack);
+        ARRAY_size(stack)--;
+        /* a node that has moved took its subtree along */
+        if (o == NULL || o->moved == mark) {
+            continue;
+        }
+        o->moved = mark;
+        o->pos += delta;
+        for (i = 0; i < Node_length(o); i++) {
+            ARRAY_add(NodePtr, &stack, Node_get(o, i));
+        }
+    }
+    ARRAY_dispose(NodePtr, &stack);
+}
+
 #ifdef NODE_USE_NODE_PRINT
 static void print_indent(unsigned level)
 {
@@ -180,15 +212,15 @@ void Node_print(Node *o)
 
 #ifdef MOZVM_MEMORY_USE_RCGC
 #if defined(MOZVM_USE_FREE_LIST) || defined(MOZVM_NODE_USE_MEMPOOL)
-static Node *free_list = NULL;
+static MOZVM_THREAD_LOCAL Node *free_list = NULL;
 #endif
 
 #ifdef MOZVM_NODE_USE_MEMPOOL
-static size_t free_object_count = 0;
-static struct page_header *current_page = NULL;
+static MOZVM_THREAD_LOCAL size_t free_object_count = 0;
+static MOZVM_THREAD_LOCAL struct page_header *current_page = NULL;
 #ifdef MOZVM_PROFILE
-static uint64_t max_arena_size = 0;
-static uint64_t arena_size = 0;
+static MOZVM_THREAD_LOCAL uint64_t max_arena_size = 0;
+static MOZVM_THREAD_LOCAL uint64_t arena_size = 0;
 #endif
 
 struct page {
@@ -276,6 +308,49 @@ void NodeManager_dispose()
 #endif /*MOZVM_NODE_USE_MEMPOOL*/
 }
 
+void NodeManager_detach(NodePool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+#ifdef MOZVM_NODE_USE_MEMPOOL
+    pool->pages = current_page;
+    pool->free_object_count = free_object_count;
+    current_page = NULL;
+    free_object_count = 0;
+#endif
+#if defined(MOZVM_USE_FREE_LIST) || defined(MOZVM_NODE_USE_MEMPOOL)
+    pool->free_list = free_list;
+    free_list = NULL;
+#endif
+}
+
+void NodeManager_adopt(NodePool *pool)
+{
+#if defined(MOZVM_USE_FREE_LIST) || defined(MOZVM_NODE_USE_MEMPOOL)
+    Node *last = pool->free_list;
+#endif
+#ifdef MOZVM_NODE_USE_MEMPOOL
+    struct page_header *page = (struct page_header *)pool->pages;
+    if (page) {
+        while (page->next) {
+            page = page->next;
+        }
+        page->next = current_page;
+        current_page = (struct page_header *)pool->pages;
+    }
+    free_object_count += pool->free_object_count;
+#endif
+#if defined(MOZVM_USE_FREE_LIST) || defined(MOZVM_NODE_USE_MEMPOOL)
+    if (last) {
+        while (last->tag) {
+            last = (Node *)last->tag;
+        }
+        last->tag = (const char *)free_list;
+        free_list = pool->free_list;
+    }
+#endif
+    memset(pool, 0, sizeof(*pool));
+}
+
 void NodeManager_print_stats()
 {
 #ifdef MOZVM_PROFILE
@@ -66,6 +66,7 @@ struct Node {
     const char *pos;
     const char *value;
     unsigned len;
+    unsigned moved; /* last Node_relocate() that moved it */
     union NodeEntry {
         struct node_small_array {
             unsigned size;
@@ -85,6 +86,12 @@ void Node_free(Node *o);
 void Node_append(Node *o, Node *n);
 Node *Node_get(Node *o, unsigned index);
 void Node_set(Node *o, unsigned index, Node *n);
+/*
+ * Moves every node reachable from roots[0..n) by delta bytes, after the
+ * input they point into was edited in place. Subtrees may be shared; each
+ * node moves once.
+ */
+void Node_relocate(Node **roots, unsigned n, long delta);
 #ifdef NODE_USE_NODE_PRINT
 void Node_print(Node *o);
 #endif
@@ -98,9 +105,26 @@ typedef void (*f_trace)(void *p, NodeVisitor *v);
 void NodeManager_add_gc_root(void *ptr, f_trace f);
 #endif
 
-
+/*
+ * The node pool is per thread: a thread calls NodeManager_init() before its
+ * first parse and NodeManager_dispose() when it is done, and a node must be
+ * released by the thread that created it.
+ */
 void NodeManager_init();
 void NodeManager_dispose();
+
+/*
+ * The pages and free nodes of a thread's pool, for a thread that built
+ * nodes another one goes on using: the first detaches its pool before it
+ * exits and the second adopts it, after which the nodes are its own.
+ */
+typedef struct NodePool {
+    void *pages;
+    Node *free_list;
+    size_t free_object_count;
+} NodePool;
+void NodeManager_detach(NodePool *pool);
+void NodeManager_adopt(NodePool *pool);
 void NodeManager_print_stats();
 void NodeManager_reset();
 
@@ -17,6 +17,15 @@
 #include "jit.h"
 #endif
 
+#ifdef MOZVM_USE_MMAP_STACK
+#include <sys/mman.h>
+#endif
+#include <unistd.h>
+#include <errno.h>
+#ifdef MOZVM_USE_SPECULATIVE_PARSE
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -58,28 +67,70 @@ MOZVM_VM_PROFILE_EACH(MOZVM_PROFILE_DECL);
 
 MOZVM_VM_MEMO_PROFILE_EACH(MOZVM_PROFILE_DECL);
 
-moz_runtime_t *moz_runtime_init(unsigned memo, unsigned nterm_size)
+/*
+ * The VM stack grows upward. With MOZVM_USE_MMAP_STACK we reserve
+ * MOZ_STACK_RESERVE_SIZE slots of address space and let the kernel commit
+ * pages on first touch, followed by a PROT_NONE guard page. Call and Alt
+ * check SP against stack_end, so a deep input ends the parse with
+ * MOZVM_PARSE_STACK_OVERFLOW instead of corrupting memory.
+ */
+static size_t moz_stack_reserved_size(void)
+{
+#ifdef MOZVM_USE_MMAP_STACK
+    return sizeof(long) * MOZ_STACK_RESERVE_SIZE;
+#else
+    return sizeof(long) * MOZ_DEFAULT_STACK_SIZE;
+#endif
+}
+
+static void moz_stack_init(moz_runtime_t *r)
+{
+    size_t size = moz_stack_reserved_size();
+#ifdef MOZVM_USE_MMAP_STACK
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *base = (char *)mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED);
+    mprotect(base + size, page, PROT_NONE);
+    r->stack_ = (long *)base;
+#else
+    r->stack_ = (long *)VM_MALLOC(size);
+    memset(r->stack_, 0xaa, size);
+#endif
+    r->stack_end = r->stack_ + size / sizeof(long);
+}
+
+static void moz_stack_dispose(moz_runtime_t *r)
+{
+#ifdef MOZVM_USE_MMAP_STACK
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    munmap(r->stack_, moz_stack_reserved_size() + page);
+#else
+    VM_FREE(r->stack_);
+#endif
+}
+
+moz_runtime_t *moz_runtime_init(unsigned memo, unsigned nterm_size, memo_type_t memo_type)
 {
     moz_runtime_t *r;
-    unsigned size = sizeof(*r) + sizeof(long) * (MOZ_DEFAULT_STACK_SIZE - 1);
-    r = (moz_runtime_t *)VM_CALLOC(1, size);
+    r = (moz_runtime_t *)VM_CALLOC(1, sizeof(*r));
     r->ast = AstMachine_init(MOZ_AST_MACHINE_DEFAULT_LOG_SIZE, NULL);
     r->table = symtable_init();
-    r->memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, memo);
-#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
+    r->memo_type = memo_type;
+    r->memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, memo, memo_type);
+#ifdef MOZVM_USE_MEMO_POINTS
     r->memo_points = (MemoPoint *)VM_CALLOC(1, sizeof(MemoPoint) * memo);
 #endif
     r->head = 0;
     r->input = r->tail = NULL;
-    memset(&r->stack_[0], 0xaa, sizeof(long) * MOZ_DEFAULT_STACK_SIZE);
-    memset(&r->stack_[MOZ_DEFAULT_STACK_SIZE - 0xf], 0xbb, sizeof(long) * 0xf);
+    moz_stack_init(r);
     r->stack = &r->stack_[0] + 0xf;
     r->fp = r->stack;
 
     r->C.memo_size = memo;
 #ifdef MOZVM_ENABLE_JIT
     r->nterm_entry = (mozvm_nterm_entry_t *) VM_CALLOC(1, sizeof(mozvm_nterm_entry_t) * (nterm_size + 1));
-    mozvm_jit_init(r);
+    r->jit_counter = (mozvm_jit_counter_t *) VM_CALLOC(1, sizeof(mozvm_jit_counter_t) * (nterm_size + 1));
 #endif
 #ifdef MOZVM_MEMORY_USE_MSGC
     NodeManager_add_gc_root(r->ast, ast_trace);
@@ -90,19 +141,20 @@ moz_runtime_t *moz_runtime_init(unsigned memo, unsigned nterm_size)
 
 void moz_runtime_reset1(moz_runtime_t *r)
 {
-    unsigned memo = r->C.memo_size;
+#ifdef MOZVM_USE_MEMO_POINTS
+    unsigned i;
+#endif
     AstMachine_dispose(r->ast);
     symtable_dispose(r->table);
-    memo_dispose(r->memo);
-#ifdef MOZVM_ENABLE_JIT
-    mozvm_jit_reset(r);
-#endif
+    memo_reset(r->memo);
 
     r->ast = AstMachine_init(MOZ_AST_MACHINE_DEFAULT_LOG_SIZE, NULL);
     r->table = symtable_init();
-    r->memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, memo);
-#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
-    memset(r->memo_points, 0, sizeof(MemoPoint) * memo);
+#ifdef MOZVM_USE_MEMO_POINTS
+    /* the profile outlives a parse; only the penalties start over */
+    for (i = 0; i < r->C.memo_size; i++) {
+        r->memo_points[i].penalty = 0;
+    }
 #endif
     r->stack = &r->stack_[0] + 0xf;
     r->fp = r->stack;
@@ -115,72 +167,207 @@ void moz_runtime_reset2(moz_runtime_t *r)
 #endif
 }
 
+/* moz_runtime_reuse() without touching the memo table */
+static void moz_runtime_rewind(moz_runtime_t *r)
+{
+#ifdef MOZVM_USE_MEMO_POINTS
+    unsigned i;
+    for (i = 0; i < r->C.memo_size; i++) {
+        r->memo_points[i].penalty = 0;
+    }
+#endif
+    AstMachine_reset(r->ast);
+    symtable_rollback(r->table, 0);
+    r->table->state = 0;
+    r->stack = &r->stack_[0] + 0xf;
+    r->fp = r->stack;
+}
+
+void moz_runtime_reuse(moz_runtime_t *r)
+{
+    moz_runtime_rewind(r);
+    memo_reset(r->memo);
+}
+
+void moz_runtime_set_record(moz_runtime_t *r, const char *str, const char *end)
+{
+    moz_runtime_reuse(r);
+#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
+    r->head = str;
+#else
+    r->head = 0;
+#endif
+    r->tail = end;
+#ifdef MOZVM_MEMO_USE_SLIDING_WINDOW
+    r->memo_swept = r->head;
+#endif
+    memo_set_base(r->memo, r->head);
+    AstMachine_setSource(r->ast, str);
+}
+
 void moz_runtime_print_stats(moz_runtime_t *r)
 {
     MOZVM_VM_PROFILE_EACH(MOZVM_PROFILE_SHOW);
     MOZVM_VM_MEMO_PROFILE_EACH(MOZVM_PROFILE_SHOW);
 }
 
-void moz_runtime_dispose(moz_runtime_t *r)
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+void moz_runtime_print_memo_points(moz_runtime_t *r, FILE *fp)
 {
     unsigned i;
-    AstMachine_dispose(r->ast);
-    symtable_dispose(r->table);
-    memo_dispose(r->memo);
-#ifdef MOZVM_USE_DYNAMIC_DEACTIVATION
-    VM_FREE(r->memo_points);
+    fprintf(fp, "# memo id lookup hit fail_hit skipped state\n");
+    for (i = 0; i < r->C.memo_size; i++) {
+        MemoPoint *mp = r->memo_points + i;
+        fprintf(fp, "memo %u %lu %lu %lu %lu %s\n", i,
+                mp->lookup, mp->hit, mp->fail_hit, mp->skipped,
+                mp->disabled ? "off" : "on");
+    }
+}
 #endif
-    if (r->C.jumps) {
-        VM_FREE(r->C.jumps);
+
+static void moz_constant_dispose(mozvm_constant_t *C)
+{
+    unsigned i;
+    if (C->jumps) {
+        VM_FREE(C->jumps);
     }
 #ifdef MOZVM_USE_JMPTBL
-    if (r->C.jumps1) {
-        VM_FREE(r->C.jumps1);
+    if (C->jumps1) {
+        VM_FREE(C->jumps1);
     }
-    if (r->C.jumps2) {
-        VM_FREE(r->C.jumps2);
+    if (C->jumps2) {
+        VM_FREE(C->jumps2);
     }
-    if (r->C.jumps3) {
-        VM_FREE(r->C.jumps3);
+    if (C->jumps3) {
+        VM_FREE(C->jumps3);
     }
 #endif
 #ifdef MOZVM_PROFILE_INST
-    if (r->C.profile) {
-        VM_FREE(r->C.profile);
+    if (C->profile) {
+        VM_FREE(C->profile);
     }
 #endif
-
-#ifdef MOZVM_ENABLE_JIT
-    VM_FREE(r->nterm_entry);
-    mozvm_jit_dispose(r);
-#endif
-    if (r->C.set_size) {
-        VM_FREE(r->C.sets);
+    if (C->fail_kind) {
+        VM_FREE(C->fail_kind);
+    }
+    if (C->set_size) {
+        VM_FREE(C->sets);
     }
-    if (r->C.table_size) {
-        for (i = 0; i < r->C.table_size; i++) {
-            pstring_delete((const char *)r->C.tables[i]);
+    if (C->table_size) {
+        for (i = 0; i < C->table_size; i++) {
+            pstring_delete((const char *)C->tables[i]);
         }
-        VM_FREE(r->C.tables);
+        VM_FREE(C->tables);
     }
-    if (r->C.tag_size) {
-        for (i = 0; i < r->C.tag_size; i++) {
-            pstring_delete((const char *)r->C.tags[i]);
+    if (C->tag_size) {
+        for (i = 0; i < C->tag_size; i++) {
+            pstring_delete((const char *)C->tags[i]);
         }
-        VM_FREE(r->C.tags);
+        VM_FREE(C->tags);
     }
-    if (r->C.str_size) {
-        for (i = 0; i < r->C.str_size; i++) {
-            pstring_delete((const char *)r->C.strs[i]);
+    if (C->str_size) {
+        for (i = 0; i < C->str_size; i++) {
+            pstring_delete((const char *)C->strs[i]);
         }
-        VM_FREE(r->C.strs);
+        VM_FREE(C->strs);
     }
-    if (r->C.nterm_size) {
-        for (i = 0; i < r->C.nterm_size; i++) {
-            pstring_delete((const char *)r->C.nterms[i]);
+    if (C->nterm_size) {
+        for (i = 0; i < C->nterm_size; i++) {
+            pstring_delete((const char *)C->nterms[i]);
         }
-        VM_FREE(r->C.nterms);
+        VM_FREE(C->nterms);
+        VM_FREE(C->nterm_code);
     }
+}
+
+moz_program_t *moz_program_init(moz_runtime_t *r, moz_inst_t *inst, void *code)
+{
+    moz_program_t *p = (moz_program_t *)VM_CALLOC(1, sizeof(*p));
+    p->refc = 1;
+    p->inst = inst;
+    p->code = code;
+    p->C = r->C;
+#ifdef MOZVM_ENABLE_JIT
+    /* the program takes over the nterms the loader found */
+    p->nterm_entry = r->nterm_entry;
+    mozvm_jit_init(p);
+#endif
+    r->program = moz_program_retain(p);
+    return p;
+}
+
+moz_program_t *moz_program_retain(moz_program_t *p)
+{
+    __sync_fetch_and_add(&p->refc, 1);
+    return p;
+}
+
+void moz_program_release(moz_program_t *p)
+{
+    if (__sync_sub_and_fetch(&p->refc, 1) != 0) {
+        return;
+    }
+#ifdef MOZVM_ENABLE_JIT
+    mozvm_jit_dispose(p);
+    VM_FREE(p->nterm_entry);
+#endif
+    moz_constant_dispose(&p->C);
+    VM_FREE(p->code);
+    VM_FREE(p);
+}
+
+void moz_runtime_attach(moz_runtime_t *r, moz_program_t *p)
+{
+    assert(r->program == NULL && r->C.memo_size == p->C.memo_size);
+#ifdef MOZVM_ENABLE_JIT
+    VM_FREE(r->nterm_entry);
+    r->nterm_entry = p->nterm_entry;
+#endif
+    r->program = moz_program_retain(p);
+    r->C = p->C;
+}
+
+#ifdef MOZVM_ENABLE_JIT
+void moz_runtime_enable_jit(moz_runtime_t *r, int enable)
+{
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+    /* see moz_runtime_incremental() */
+    if (enable && r->reach) {
+        fprintf(stderr, "warning: an incremental runtime does not use the jit\n");
+        return;
+    }
+#endif
+    r->jit = enable;
+}
+#endif
+
+void moz_runtime_dispose(moz_runtime_t *r)
+{
+    AstMachine_dispose(r->ast);
+    symtable_dispose(r->table);
+    memo_dispose(r->memo);
+#ifdef MOZVM_USE_MEMO_POINTS
+    VM_FREE(r->memo_points);
+#endif
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+    if (r->reach) {
+        VM_FREE(r->reach);
+    }
+#endif
+#ifdef MOZVM_ENABLE_JIT
+    VM_FREE(r->jit_counter);
+#endif
+    if (r->program) {
+        moz_program_release(r->program);
+    }
+    else {
+        /* a runtime the loader failed to turn into a program */
+#ifdef MOZVM_ENABLE_JIT
+        VM_FREE(r->nterm_entry);
+#endif
+        moz_constant_dispose(&r->C);
+    }
+    moz_stack_dispose(r);
     VM_FREE(r);
 }
 
@@ -211,6 +398,16 @@ void moz_runtime_dispose(moz_runtime_t *r)
 
 #define PUSH(X) *SP++ = (long)(X)
 #define POP()  *--SP
+#define STACK_OVERFLOW() do { \
+    runtime->stack = SP; \
+    runtime->fp    = FP; \
+    return MOZVM_PARSE_STACK_OVERFLOW; \
+} while (0)
+#define CHECK_STACK_OVERFLOW() do { \
+    if (SP + MOZ_STACK_REDZONE > runtime->stack_end) { \
+        STACK_OVERFLOW(); \
+    } \
+} while (0)
 
 #define ABORT() __asm volatile("int3")
 
@@ -247,6 +444,169 @@ void moz_runtime_dispose(moz_runtime_t *r)
     POS    = (mozpos_t *)(FP+FP_POS);\
 } while (0)
 
+/*
+ * The oldest Alt frame bounds how far the parser can still backtrack;
+ * the bottom frame pushed by moz_runtime_parse_init() only catches the
+ * failure of the whole parse and does not count.
+ */
+static long *moz_runtime_oldest_frame(long *FP)
+{
+    long *oldest = NULL;
+    while ((long *)FP[FP_FP] != FP) {
+        oldest = FP;
+        FP = (long *)FP[FP_FP];
+    }
+    return oldest;
+}
+
+/*
+ * AST_MODE_EVENT: fire the events of the logs no frame can roll back.
+ * Unlike the memo sweep, this does not stop at the oldest frame: the memo
+ * frame around a start rule or the Alt of an optional list stays for the
+ * whole document. A frame resuming at MemoFail only fails on into the one
+ * below it, and the frame below a repetition is popped by the Succ the
+ * repetition ends with, so neither rolls back the log by itself. The rest
+ * of the frames bound the flush; the failure of the whole parse does not,
+ * as documented for AstEvents.
+ */
+void moz_runtime_flush_events(moz_runtime_t *runtime, long *FP)
+{
+    AstMachine *ast = runtime->ast;
+    const uint8_t *kinds = runtime->C.fail_kind;
+    const moz_inst_t *head = runtime->program ? runtime->program->inst : NULL;
+    long tx = ast_save_tx(ast);
+    int popped = 0;
+    while ((long *)FP[FP_FP] != FP) {
+        int kind = MOZVM_FAIL_RESUME;
+        if (kinds && head) {
+            kind = kinds[(const moz_inst_t *)FP[FP_NEXT] - head];
+        }
+        if (popped) {
+            /* popped by the repetition above it before it can fail */
+            popped = 0;
+        }
+        else {
+            if (kind != MOZVM_FAIL_RETHROW && FP[FP_AST] < tx) {
+                tx = FP[FP_AST];
+            }
+            popped = kind == MOZVM_FAIL_COMMIT;
+        }
+        FP = (long *)FP[FP_FP];
+    }
+    ast_flush_events(ast, tx);
+}
+
+#define AST_FLUSH() do { \
+    if (AST_MACHINE_GET()->mode == AST_MODE_EVENT && \
+            ast_save_tx(AST_MACHINE_GET()) - AST_MACHINE_GET()->flushed >= MOZ_AST_FLUSH_INTERVAL) { \
+        moz_runtime_flush_events(runtime, FP); \
+    } \
+} while (0)
+
+#ifdef MOZVM_MEMO_USE_SLIDING_WINDOW
+static void moz_runtime_memo_sweep(moz_runtime_t *runtime, long *FP, mozpos_t pos)
+{
+    long *oldest = moz_runtime_oldest_frame(FP);
+    if (oldest) {
+        memo_sweep(runtime->memo, (mozpos_t)oldest[FP_POS]);
+    }
+    runtime->memo_swept = pos;
+}
+
+#define MEMO_SWEEP() do { \
+    if ((long)(GET_POS() - runtime->memo_swept) >= MOZ_MEMO_SWEEP_INTERVAL) { \
+        moz_runtime_memo_sweep(runtime, FP, GET_POS()); \
+    } \
+} while (0)
+#else
+#define MEMO_SWEEP()
+#endif
+
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+#define MEMO_POINT_ENABLED(ID) (!runtime->memo_points[ID].disabled)
+#else
+#define MEMO_POINT_ENABLED(ID) 1
+#endif
+
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+/*
+ * How far the parse of a memo entry went, for memo_edit(). head already
+ * holds the furthest position a failure backtracked from; a memoized call
+ * saves it and starts it over from its own position, and when the call
+ * ends the furthest of head and where it stands is both its reach and
+ * what head goes back to if that is further than the saved value.
+ */
+static void moz_reach_enter(moz_runtime_t *r, mozpos_t pos)
+{
+    if (r->reach_top == r->reach_size) {
+        r->reach_size *= 2;
+        r->reach = (mozpos_t *)VM_REALLOC(r->reach, sizeof(mozpos_t) * r->reach_size);
+    }
+    r->reach[r->reach_top++] = r->head;
+    r->head = pos;
+}
+
+static uint32_t moz_reach_leave(moz_runtime_t *r, mozpos_t pos, mozpos_t cur)
+{
+    mozpos_t saved = r->reach[--r->reach_top];
+    mozpos_t furthest = r->head < cur ? cur : r->head;
+    r->head = saved < furthest ? furthest : saved;
+    return (uint32_t)(furthest - pos);
+}
+
+/* a memo hit went as far as the parse that stored it */
+static void moz_reach_skip(moz_runtime_t *r, mozpos_t pos, uint32_t reach)
+{
+    mozpos_t saved = r->reach[--r->reach_top];
+    assert(reach != MEMO_REACH_UNKNOWN);
+    r->head = saved < pos + reach ? pos + reach : saved;
+}
+
+#define REACH_ENTER() do { \
+    if (runtime->reach) { \
+        moz_reach_enter(runtime, GET_POS()); \
+    } \
+} while (0)
+#define REACH_LEAVE(POS) \
+    (runtime->reach ? moz_reach_leave(runtime, POS, GET_POS()) : MEMO_REACH_UNKNOWN)
+#define REACH_SKIP(ENTRY) do { \
+    if (runtime->reach) { \
+        moz_reach_skip(runtime, GET_POS(), memo_entry_reach(MEMO_GET(), ENTRY)); \
+    } \
+} while (0)
+/* the parse looked at POS without failing back from it */
+#define REACH_MARK(POS) do { \
+    if (runtime->reach && HEAD < (POS)) { \
+        HEAD = (POS); \
+    } \
+} while (0)
+#else
+#define REACH_ENTER()
+#define REACH_LEAVE(POS)  MEMO_REACH_UNKNOWN
+#define REACH_SKIP(ENTRY)
+#define REACH_MARK(POS)
+#endif
+
+#ifdef MOZVM_USE_SPECULATIVE_PARSE
+static const moz_splice_entry_t *moz_splice_find(moz_splice_t *splice, mozpos_t pos)
+{
+    unsigned lo = 0, hi = splice->size;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (splice->entries[mid].pos < pos) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo < splice->size && splice->entries[lo].pos == pos) {
+        return &splice->entries[lo];
+    }
+    return NULL;
+}
+#endif
+
 moz_inst_t *moz_runtime_parse_init(moz_runtime_t *runtime, const char *str, moz_inst_t *PC)
 {
     long *SP = runtime->stack;
@@ -276,7 +636,8 @@ moz_inst_t *moz_runtime_parse_init(moz_runtime_t *runtime, const char *str, moz_
     //   PC[3]  0    /*parse fail   */
     //   PC[4]  ...
 #ifdef MOZVM_USE_DIRECT_THREADING
-    assert(*(void const **)PC == &&LABEL(Exit));
+    assert(*(void const **)PC ==
+            ((void const **)moz_runtime_parse(runtime, NULL, NULL))[Exit]);
 #else
     assert(*PC == Exit);
 #endif
@@ -292,6 +653,9 @@ moz_inst_t *moz_runtime_parse_init(moz_runtime_t *runtime, const char *str, moz_
 #endif
     PUSH(PC);
     PC += 2 * (MOZVM_INST_HEADER_SIZE + 1);
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+    runtime->reach_top = 0;
+#endif
     runtime->stack = SP;
     runtime->fp    = FP;
     return PC;
@@ -300,7 +664,8 @@ moz_inst_t *moz_runtime_parse_init(moz_runtime_t *runtime, const char *str, moz_
 long moz_runtime_parse(moz_runtime_t *runtime, const char *str, const moz_inst_t *PC)
 {
 #ifdef MOZVM_PROFILE_INST
-    const moz_inst_t *BEGIN = PC;
+    /* counted by offset from the program head, whatever PC the parse starts at */
+    const moz_inst_t *BEGIN = runtime->program->inst;
 #define PROFILE_INST(PC) runtime->C.profile[(PC) - BEGIN]++;
 #else
 #define PROFILE_INST(PC)
@@ -380,6 +745,8 @@ long moz_runtime_parse(moz_runtime_t *runtime, const char *str, const moz_inst_t
 #define read_BITSET_t(PC)  *((BITSET_t *)PC);  PC += sizeof(BITSET_t)
 #define read_TAG_t(PC)     *((TAG_t *)PC);     PC += sizeof(TAG_t)
 #define read_JMPTBL_t(PC)  *((JMPTBL_t *)PC);  PC += sizeof(JMPTBL_t)
+/* first operand of the instruction that follows PC (for superinstructions) */
+#define peek_next_operand(T, PC) (*((T *)((PC) + MOZVM_INST_HEADER_SIZE)))
 
 #define OP_CASE_(OP) LABEL(OP): PROFILE_INST(PC-1); MOZVM_PROFILE_INC(INST_COUNT);
 #ifdef PRINT_INST
@@ -399,6 +766,9 @@ long moz_runtime_parse(moz_runtime_t *runtime, const char *str, const moz_inst_t
 
 #else
 #define OP_CASE(OP) OP_CASE_(OP)
+#endif
+#ifdef MOZVM_ENABLE_JIT
+    runtime->jit_stack_limit = mozvm_jit_stack_limit();
 #endif
     DISPATCH_START(PC);
 #include "vm_core.c"
@@ -407,6 +777,335 @@ long moz_runtime_parse(moz_runtime_t *runtime, const char *str, const moz_inst_t
     return 0;
 }
 
+/* NUL bytes kept after the buffered input (see load_file in loader.c) */
+#define MOZ_STREAM_PADDING 32
+
+void moz_stream_init(moz_stream_t *s, int fd)
+{
+    s->capacity = MOZ_STREAM_CHUNK_SIZE;
+    s->buf = (char *)VM_CALLOC(1, s->capacity + MOZ_STREAM_PADDING);
+    s->begin = s->size = s->offset = 0;
+    s->fd = fd;
+    s->eof = 0;
+    s->start = -1;
+}
+
+void moz_stream_dispose(moz_stream_t *s)
+{
+    VM_FREE(s->buf);
+    s->buf = NULL;
+}
+
+int moz_stream_fill(moz_stream_t *s, size_t want)
+{
+    size_t readed = 0;
+    if (s->begin > 0) {
+        /* parsed documents are gone; slide the rest to the front */
+        memmove(s->buf, s->buf + s->begin, s->size - s->begin);
+        s->size -= s->begin;
+        s->offset += s->begin;
+        s->begin = 0;
+    }
+    while (s->capacity - s->size < (want < MOZ_STREAM_CHUNK_SIZE ? MOZ_STREAM_CHUNK_SIZE : want)) {
+        s->capacity *= 2;
+        s->buf = (char *)VM_REALLOC(s->buf, s->capacity + MOZ_STREAM_PADDING);
+    }
+    while (!s->eof && readed < want) {
+        ssize_t n = read(s->fd, s->buf + s->size + readed, s->capacity - s->size - readed);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            s->eof = 1;
+            break;
+        }
+        readed += (size_t)n;
+        /* small requests take whatever a pipe has, so that a slow feed
+         * is parsed as it arrives; large ones (a document that outgrew
+         * the window) wait for all of it to keep reparsing linear */
+        if (want < MOZ_STREAM_CHUNK_SIZE) {
+            break;
+        }
+    }
+    s->size += readed;
+    memset(s->buf + s->size, 0, MOZ_STREAM_PADDING);
+    return readed > 0;
+}
+
+static inline int moz_stream_is_separator(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+long moz_runtime_parse_stream(moz_runtime_t *r, moz_stream_t *s,
+        moz_inst_t *inst, Node **node)
+{
+    while (1) {
+        const char *str, *end;
+        size_t reach, consumed;
+        long parsed;
+
+        /* whitespace between documents (the newlines of NDJSON, spaces
+         * between concatenated documents) belongs to none of them */
+        while (s->begin < s->size && moz_stream_is_separator(s->buf[s->begin])) {
+            s->begin++;
+        }
+        str = s->buf + s->begin;
+        end = s->buf + s->size;
+        if (str == end) {
+            if (s->eof || !moz_stream_fill(s, 1)) {
+                return MOZVM_PARSE_END_OF_STREAM;
+            }
+            continue;
+        }
+        moz_runtime_reuse(r);
+        moz_runtime_set_source(r, str, end);
+        parsed = moz_runtime_parse(r, str, s->start < 0
+                ? moz_runtime_parse_init(r, str, inst)
+                : moz_runtime_parse_init_nterm(r, str, inst, s->start));
+#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
+        consumed = r->stop - str;
+        reach = (r->head < r->stop ? r->stop : r->head) - str;
+#else
+        consumed = r->stop;
+        reach = r->head < r->stop ? r->stop : r->head;
+#endif
+        if (parsed == MOZVM_PARSE_STACK_OVERFLOW) {
+            return parsed;
+        }
+        if (!s->eof && reach + MOZ_STREAM_LOOKAHEAD >= (size_t)(end - str)) {
+            /* double the window so that a long document costs O(n) */
+            if (parsed == 0) {
+                Node *o = ast_get_parsed_node(r->ast);
+                if (o) {
+                    NODE_GC_RELEASE(o);
+                }
+            }
+            moz_stream_fill(s, end - str);
+            continue;
+        }
+        if (parsed != 0 || consumed == 0) {
+            return 1;
+        }
+        *node = ast_get_parsed_node(r->ast);
+        s->begin += consumed;
+        return 0;
+    }
+}
+
+moz_inst_t *moz_runtime_parse_init_nterm(moz_runtime_t *r, const char *str,
+        moz_inst_t *head, unsigned nterm)
+{
+    assert(nterm < r->C.nterm_size);
+    /* the frame returns to and fails into the exit stubs at head */
+    moz_runtime_parse_init(r, str, head);
+    return r->C.nterm_code[nterm];
+}
+
+int moz_runtime_find_nterm(moz_runtime_t *r, const char *name)
+{
+    unsigned i;
+    for (i = 0; i < r->C.nterm_size; i++) {
+        if (strcmp(r->C.nterms[i], name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+#ifdef MOZVM_USE_INCREMENTAL_PARSE
+void moz_runtime_incremental(moz_runtime_t *r)
+{
+    unsigned i, len = 1;
+    for (i = 0; i < r->C.str_size; i++) {
+        if (pstring_length(r->C.strs[i]) > len) {
+            len = pstring_length(r->C.strs[i]);
+        }
+    }
+    /* Str2 compares two strings at once */
+    r->lookahead = 2 * len;
+    memo_dispose(r->memo);
+    r->memo_type = MEMO_TYPE_RETAIN;
+    r->memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, r->C.memo_size, r->memo_type);
+#ifdef MOZVM_MEMORY_USE_MSGC
+    NodeManager_add_gc_root(r->memo, memo_trace);
+#endif
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+    for (i = 0; i < r->C.memo_size; i++) {
+        r->memo_points[i].disabled = 0;
+        r->memo_points[i].pinned = 1;
+    }
+#endif
+    if (r->reach == NULL) {
+        r->reach_size = 64;
+        r->reach = (mozpos_t *)VM_MALLOC(sizeof(mozpos_t) * r->reach_size);
+    }
+#ifdef MOZVM_ENABLE_JIT
+    /* compiled code does not keep track of how far it looked */
+    if (r->jit) {
+        fprintf(stderr, "warning: an incremental runtime does not use the jit\n");
+        r->jit = 0;
+    }
+#endif
+}
+
+long moz_runtime_reparse(moz_runtime_t *r, const char *str, const char *end,
+        moz_inst_t *head, size_t offset, size_t removed, size_t inserted)
+{
+#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
+    mozpos_t begin = str + offset;
+#else
+    mozpos_t begin = offset;
+#endif
+    memo_edit(r->memo, begin, begin + removed, (long)inserted - (long)removed, r->lookahead);
+    moz_runtime_rewind(r);
+    moz_runtime_set_source(r, str, end);
+    return moz_runtime_parse(r, str, moz_runtime_parse_init(r, str, head));
+}
+#endif
+
+#ifdef MOZVM_USE_SPECULATIVE_PARSE
+/* one thread parsing nterm after every sep in [begin, end) */
+typedef struct moz_speculator_t {
+    pthread_t thread;
+    moz_runtime_t *parent;
+    moz_inst_t *inst;
+    unsigned nterm;
+    int sep;
+    const char *begin;
+    const char *end;
+    AstMachine *logs; /* the ast logs of every result, kept for splicing */
+    moz_splice_entry_t *entries;
+    unsigned size;
+    unsigned capacity;
+    int started;
+    NodePool pool;
+} moz_speculator_t;
+
+static const char *moz_skip_blank(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+    return p;
+}
+
+static void moz_speculator_add(moz_speculator_t *s, moz_runtime_t *r, const char *pos)
+{
+    moz_splice_entry_t *e;
+    if (s->size == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 64;
+        s->entries = (moz_splice_entry_t *)VM_REALLOC(s->entries,
+                sizeof(moz_splice_entry_t) * s->capacity);
+    }
+    e = s->entries + s->size++;
+    e->pos = pos;
+    e->end = r->stop;
+    /* an index into s->logs until the buffer stops moving */
+    e->logs = (const AstLog *)(uintptr_t)ARRAY_size(s->logs->logs);
+    e->nlog = ARRAY_size(r->ast->logs);
+    ast_log_splice(s->logs, ARRAY_n(r->ast->logs, 0), e->nlog);
+}
+
+static void *moz_speculator_main(void *arg)
+{
+    moz_speculator_t *s = (moz_speculator_t *)arg;
+    moz_runtime_t *parent = s->parent;
+    moz_runtime_t *r;
+    const char *tail = parent->tail;
+    const char *p = s->begin;
+
+    NodeManager_init();
+    r = moz_runtime_init(parent->C.memo_size, parent->C.nterm_size, parent->memo_type);
+    moz_runtime_attach(r, parent->program);
+#ifdef MOZVM_ENABLE_JIT
+    r->jit = parent->jit;
+#endif
+    moz_runtime_set_source(r, s->begin, s->end);
+    s->logs = AstMachine_init(MOZ_AST_MACHINE_DEFAULT_LOG_SIZE, NULL);
+    while (p < s->end && (p = (const char *)memchr(p, s->sep, s->end - p)) != NULL) {
+        p = moz_skip_blank(p + 1, tail);
+        moz_runtime_set_record(r, p, tail);
+        if (moz_runtime_parse(r, p, moz_runtime_parse_init_nterm(r, p, s->inst, s->nterm)) == 0) {
+            moz_speculator_add(s, r, p);
+            p = r->stop;
+        }
+    }
+    moz_runtime_dispose(r);
+    /* the results outlive this thread; the parsing thread adopts them */
+    NodeManager_detach(&s->pool);
+    return NULL;
+}
+
+long moz_runtime_parse_parallel(moz_runtime_t *r, const char *str,
+        const moz_inst_t *inst, unsigned nterm, int sep, unsigned nworker)
+{
+    moz_speculator_t *workers;
+    moz_splice_t splice = {};
+    size_t size = r->tail - str, chunk;
+    unsigned i, j, n = 0;
+    long parsed;
+
+    if (size / MOZ_SPECULATION_MIN_CHUNK < nworker) {
+        nworker = size / MOZ_SPECULATION_MIN_CHUNK;
+    }
+#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
+    if (r->program == NULL || nterm >= r->C.nterm_size || nworker < 2)
+#endif
+    {
+        return moz_runtime_parse(r, str, moz_runtime_parse_init(r, str, (moz_inst_t *)inst));
+    }
+
+    workers = (moz_speculator_t *)VM_CALLOC(nworker, sizeof(moz_speculator_t));
+    chunk = size / nworker;
+    for (i = 0; i < nworker; i++) {
+        moz_speculator_t *s = &workers[i];
+        s->parent = r;
+        s->inst = (moz_inst_t *)inst;
+        s->nterm = nterm;
+        s->sep = sep;
+        s->begin = str + chunk * i;
+        s->end = i + 1 == nworker ? r->tail : s->begin + chunk;
+        /* if it fails, this part is left to the parse on r */
+        s->started = pthread_create(&s->thread, NULL, moz_speculator_main, s) == 0;
+    }
+    for (i = 0; i < nworker; i++) {
+        moz_speculator_t *s = &workers[i];
+        if (s->started) {
+            pthread_join(s->thread, NULL);
+            NodeManager_adopt(&s->pool);
+            n += s->size;
+        }
+    }
+
+    /* the parts are in order and so are the results of each part */
+    splice.code = r->C.nterm_code[nterm];
+    splice.entries = (moz_splice_entry_t *)VM_MALLOC(sizeof(moz_splice_entry_t) * (n + 1));
+    for (i = 0; i < nworker; i++) {
+        moz_speculator_t *s = &workers[i];
+        for (j = 0; j < s->size; j++) {
+            moz_splice_entry_t *e = &splice.entries[splice.size++];
+            *e = s->entries[j];
+            e->logs = ARRAY_n(s->logs->logs, (uintptr_t)e->logs);
+        }
+    }
+
+    r->splice = &splice;
+    parsed = moz_runtime_parse(r, str, moz_runtime_parse_init(r, str, (moz_inst_t *)inst));
+    r->splice = NULL;
+
+    for (i = 0; i < nworker; i++) {
+        if (workers[i].logs) {
+            AstMachine_dispose(workers[i].logs);
+        }
+        VM_FREE(workers[i].entries);
+    }
+    VM_FREE(splice.entries);
+    VM_FREE(workers);
+    return parsed;
+}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
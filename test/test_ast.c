@@ -1,5 +1,6 @@
 #include "ast.h"
 #include "pstring.h"
+#include <stdio.h>
 #include <string.h>
 
 static struct tag {
@@ -16,6 +17,49 @@ static struct tag {
 #undef STRING
 };
 
+/* AST_MODE_EVENT: every event is appended to buf */
+typedef struct recorder {
+    const char *source;
+    char buf[512];
+    unsigned len;
+} recorder_t;
+
+#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
+#define OFFSET(R, P) ((unsigned long)((P) - (R)->source))
+#else
+#define OFFSET(R, P) ((unsigned long)(P))
+#endif
+
+#define RECORD(R, ...) \
+    ((R)->len += snprintf((R)->buf + (R)->len, sizeof((R)->buf) - (R)->len, __VA_ARGS__))
+
+static void record_new(void *ctx, mozpos_t pos)
+{
+    recorder_t *r = (recorder_t *)ctx;
+    RECORD(r, "new %lu|", OFFSET(r, pos));
+}
+
+static void record_tag(void *ctx, const char *tag)
+{
+    RECORD((recorder_t *)ctx, "tag %s|", tag);
+}
+
+static void record_capture(void *ctx, mozpos_t pos)
+{
+    recorder_t *r = (recorder_t *)ctx;
+    RECORD(r, "cap %lu|", OFFSET(r, pos));
+}
+
+static void record_link(void *ctx)
+{
+    RECORD((recorder_t *)ctx, "link|");
+}
+
+static void record_pop(void *ctx, const char *label)
+{
+    RECORD((recorder_t *)ctx, "pop %s|", label ? label : "");
+}
+
 int main(int argc, char const* argv[])
 {
 #define TAG_String   ((char *)tags[0].tag)
@@ -134,6 +178,63 @@ int main(int argc, char const* argv[])
 #endif
     // asm volatile("int3");
     NODE_GC_RELEASE(node);
+
+    {
+        recorder_t r = {};
+        AstEvents events = {};
+        long tx, list_tx;
+        events.ctx = &r;
+        events.on_new = record_new;
+        events.on_tag = record_tag;
+        events.on_capture = record_capture;
+        events.on_link = record_link;
+        events.on_pop = record_pop;
+        r.source = str;
+        AstMachine_setMode(ast, AST_MODE_EVENT, &events);
+        ast_log_new(ast, POS(0));
+        tx = ast_start_tx(ast);
+        ast_log_new(ast, POS(3));
+        ast_log_tag(ast, TAG_String);
+        ast_log_capture(ast, POS(6));
+        ast_commit_tx(ast, "str", tx);
+        list_tx = ast_start_tx(ast);
+        ast_log_new(ast, POS(10));
+        tx = ast_start_tx(ast);
+        ast_log_new(ast, POS(11));
+        ast_log_tag(ast, TAG_Integer);
+        ast_log_capture(ast, POS(13));
+        ast_commit_tx(ast, "int1", tx);
+        // a child that is backtracked never reaches the callbacks; like
+        // the VM, roll back to the transaction saved before its TStart
+        tx = ast_save_tx(ast);
+        ast_start_tx(ast);
+        ast_log_new(ast, POS(15));
+        ast_log_capture(ast, POS(18));
+        ast_rollback_tx(ast, tx);
+        ast_log_tag(ast, TAG_List);
+        ast_log_capture(ast, POS(19));
+        ast_commit_tx(ast, "list", list_tx);
+        ast_log_tag(ast, TAG_JSON);
+        ast_log_capture(ast, POS(21));
+        assert(ast_get_parsed_node(ast) == NULL);
+        assert(strcmp(r.buf,
+                    "new 0|"
+                    "link|new 3|tag String|cap 6|pop str|"
+                    "link|new 10|"
+                    "link|new 11|tag Integer|cap 13|pop int1|"
+                    "tag List|cap 19|pop list|"
+                    "tag JSON|cap 21|") == 0);
+        assert(ast_save_tx(ast) == ast->base);
+
+        AstMachine_setMode(ast, AST_MODE_RECOGNIZE, NULL);
+        ast_log_new(ast, POS(0));
+        tx = ast_start_tx(ast);
+        ast_log_capture(ast, POS(21));
+        ast_commit_tx(ast, "x", tx);
+        assert(ast_save_tx(ast) == 0);
+        assert(ast_get_parsed_node(ast) == NULL);
+        AstMachine_setMode(ast, AST_MODE_TREE, NULL);
+    }
     AstMachine_dispose(ast);
     for (i = 0; i < 5; i++) {
         struct tag *t = &tags[i];
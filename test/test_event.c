@@ -0,0 +1,109 @@
+#include "mozvm.h"
+#include "loader.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * AST_MODE_EVENT must stream: on a long document the events are fired
+ * while the parse goes on, and the log only holds what is not fired yet.
+ *   test_event bytecode
+ * The bytecode is a JSON grammar (test/json.nzc); the input is a list of
+ * RECORDS objects built here.
+ */
+
+#define RECORDS 20000
+#define RECORD  "{\"k\": [1, \"s\", true]},\n"
+/* an Object, a KeyValue, its String key, an Array and its three values */
+#define NODES_PER_RECORD 7
+#define PADDING 64
+
+typedef struct counter {
+    AstMachine *ast;
+    unsigned long nodes;
+    unsigned long events;
+    unsigned max_logs;
+} counter_t;
+
+static void count_log_size(counter_t *c)
+{
+    if (ARRAY_size(c->ast->logs) > c->max_logs) {
+        c->max_logs = ARRAY_size(c->ast->logs);
+    }
+    c->events++;
+}
+
+static void count_new(void *ctx, mozpos_t pos)
+{
+    counter_t *c = (counter_t *)ctx;
+    c->nodes++;
+    count_log_size(c);
+    (void)pos;
+}
+
+static void count_pop(void *ctx, const char *label)
+{
+    count_log_size((counter_t *)ctx);
+    (void)label;
+}
+
+int main(int argc, char const* argv[])
+{
+    mozvm_loader_t L = {};
+    AstEvents events = {};
+    counter_t c = {};
+    moz_inst_t *head, *inst;
+    size_t len = strlen(RECORD), size = 0;
+    char *input;
+    long parsed;
+    unsigned i;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s bytecode\n", argv[0]);
+        return 1;
+    }
+    NodeManager_init();
+    if ((head = mozvm_loader_load_file(&L, argv[1])) == NULL) {
+        fprintf(stderr, "error: failed to load '%s'\n", argv[1]);
+        return 1;
+    }
+    input = (char *)VM_CALLOC(1, 2 + RECORDS * len + PADDING);
+    input[size++] = '[';
+    for (i = 0; i < RECORDS; i++) {
+        memcpy(input + size, RECORD, len);
+        size += len;
+    }
+    /* no comma after the last record */
+    input[size - 2] = ']';
+    input[--size] = '\0';
+
+    c.ast = L.R->ast;
+    events.ctx = &c;
+    events.on_new = count_new;
+    events.on_pop = count_pop;
+    AstMachine_setMode(L.R->ast, AST_MODE_EVENT, &events);
+    moz_runtime_set_source(L.R, input, input + size);
+    inst = moz_runtime_parse_init(L.R, input, head);
+    parsed = moz_runtime_parse(L.R, input, inst);
+    /* fires the rest */
+    ast_get_parsed_node(L.R->ast);
+
+    if (parsed != 0) {
+        fprintf(stderr, "error: parse failed (%ld)\n", parsed);
+        return 1;
+    }
+    if (c.nodes != 2 + (unsigned long)RECORDS * NODES_PER_RECORD) {
+        fprintf(stderr, "error: %lu nodes\n", c.nodes);
+        return 1;
+    }
+    /* the whole document is one list, yet only a few flush intervals of
+     * logs are ever buffered */
+    if (c.max_logs > 4 * MOZ_AST_FLUSH_INTERVAL || c.events < 16 * MOZ_AST_FLUSH_INTERVAL) {
+        fprintf(stderr, "error: %u logs buffered for %lu events\n", c.max_logs, c.events);
+        return 1;
+    }
+    VM_FREE(input);
+    moz_runtime_dispose(L.R);
+    mozvm_loader_dispose(&L);
+    NodeManager_dispose();
+    return 0;
+}
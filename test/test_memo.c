@@ -1,25 +1,181 @@
+/* the checks below are asserts; keep them in release builds too */
+#undef NDEBUG
 #include "memo.h"
 #include <stdio.h>
 #include <assert.h>
 
-int main(int argc, char const* argv[])
-{
 #ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
-    char *str = "hello world";
+static char str[64] = "hello world";
+#define POS(N) (str + (N))
+#else
+#define POS(N) (N)
 #endif
+/* N bytes into the fifth GiB of an input at POS(0) */
+#define FAR(N) ((mozpos_t)((uintptr_t)POS(N) + ((uint64_t)1 << 32)))
+
+static void test_memo(memo_type_t type)
+{
     memo_t *memo;
     MemoEntry_t *e;
+    unsigned i;
+    Node *node;
+    memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, 4, type);
+    memo_set_base(memo, POS(0));
+    memo_set(memo, POS(0), 0, NULL, 0, 0, MEMO_REACH_UNKNOWN);
+    e = memo_get(memo, POS(0), 0, 0);
+    assert(memo_entry_result(memo, e) == NULL);
+    assert(memo_get(memo, POS(0), 0, 1) == NULL);
+
+    node = Node_new("x", NULL, 0, 0, NULL);
+    memo_set(memo, POS(4), 1, node, 2, 0, MEMO_REACH_UNKNOWN);
+    e = memo_get(memo, POS(4), 1, 0);
+    assert(e != NULL && memo_entry_result(memo, e) == node);
+
+    memo_set(memo, POS(1), 2, NULL, 3, 0, MEMO_REACH_UNKNOWN);
+    memo_fail(memo, POS(2), 1, MEMO_REACH_UNKNOWN);
+    e = memo_get(memo, POS(1), 2, 0);
+    assert(e != NULL && e->consumed == 3);
+    e = memo_get(memo, POS(2), 1, 0);
+    assert(e != NULL && e->consumed == MEMO_ENTRY_FAILED);
+    assert(memo_get(memo, POS(1), 2, 1) == NULL);
+    assert(memo_get(memo, POS(3), 3, 0) == NULL);
+
+    /* overflow the table; the most recent entry must survive */
+    for (i = 0; i < 60; i++) {
+        memo_set(memo, POS(i), i % 4, NULL, i, 0, MEMO_REACH_UNKNOWN);
+    }
+    e = memo_get(memo, POS(59), 59 % 4, 0);
+    assert(e != NULL && e->consumed == 59);
+
+    /* a sweep drops what lies behind the frontier and keeps the rest */
+    memo_set(memo, POS(1), 1, NULL, 1, 0, MEMO_REACH_UNKNOWN);
+    memo_set(memo, POS(6), 2, NULL, 1, 0, MEMO_REACH_UNKNOWN);
+    memo_sweep(memo, POS(5));
+    assert(memo_get(memo, POS(1), 1, 0) == NULL);
+    e = memo_get(memo, POS(6), 2, 0);
+    assert(e != NULL && e->consumed == 1);
+
+    /* entries must not survive a reset, whatever window it picks */
+    memo_reset(memo);
+    memo_reserve(memo, 60);
+    assert(memo_get(memo, POS(59), 59 % 4, 0) == NULL);
+    memo_set(memo, POS(7), 3, NULL, 1, 0, MEMO_REACH_UNKNOWN);
+    e = memo_get(memo, POS(7), 3, 0);
+    assert(e != NULL && e->consumed == 1);
+
+    /* including the one that wraps the generation around */
+    node = Node_new("y", NULL, 0, 0, NULL);
+    NODE_GC_RETAIN(node);
+    for (i = 0; i < 300; i++) {
+        memo_reset(memo);
+        assert(memo_get(memo, POS(7), 3, 0) == NULL);
+        memo_set(memo, POS(7), 3, node, i, 0, MEMO_REACH_UNKNOWN);
+        e = memo_get(memo, POS(7), 3, 0);
+        assert(e != NULL && e->consumed == i && memo_entry_result(memo, e) == node);
+    }
+    NODE_GC_RELEASE(node);
+    memo_dispose(memo);
+}
+
+static void test_memo_edit(void)
+{
+    static char text[32];
+    memo_t *memo;
+    MemoEntry_t *e;
+    Node *node;
+    memo = memo_init(4, 4, MEMO_TYPE_RETAIN);
+    memo_set_base(memo, POS(0));
+    node = Node_new("x", text + 20, 2, 0, NULL);
+    /* far before the edit, sees up to it, spans it, and after it */
+    memo_set(memo, POS(0), 0, NULL, 2, 0, 3);
+    memo_set(memo, POS(2), 1, NULL, 2, 0, 9);
+    memo_set(memo, POS(8), 2, NULL, 4, 0, 4);
+    memo_set(memo, POS(20), 3, node, 2, 0, 2);
+    memo_fail(memo, POS(21), 0, 1);
+    /* a retained table grows instead of evicting */
+    assert(memo_get(memo, POS(0), 0, 0) != NULL);
+
+    /* replace [10, 12) with five bytes */
+    memo_edit(memo, POS(10), POS(12), 3, 1);
+    e = memo_get(memo, POS(0), 0, 0);
+    assert(e != NULL && e->consumed == 2 && memo_entry_reach(memo, e) == 3);
+    assert(memo_get(memo, POS(2), 1, 0) == NULL);
+    assert(memo_get(memo, POS(8), 2, 0) == NULL);
+    assert(memo_get(memo, POS(20), 3, 0) == NULL);
+    e = memo_get(memo, POS(23), 3, 0);
+    assert(e != NULL && memo_entry_result(memo, e) == node);
+    assert(node->pos == text + 23);
+    e = memo_get(memo, POS(24), 0, 0);
+    assert(e != NULL && e->consumed == MEMO_ENTRY_FAILED);
+    memo_dispose(memo);
+}
+
+/* positions 4 GiB apart must not share an entry */
+static void test_memo_base(memo_type_t type)
+{
+    memo_t *memo;
+    MemoEntry_t *e;
+    memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, 4, type);
+    memo_set_base(memo, POS(0));
+    memo_set(memo, POS(5), 1, NULL, 3, 0, MEMO_REACH_UNKNOWN);
+    assert(memo_get(memo, FAR(5), 1, 0) == NULL);
+    /* past what a key can hold, nothing is memoized */
+    assert(memo_set(memo, FAR(6), 2, NULL, 3, 0, MEMO_REACH_UNKNOWN) == 0);
+    assert(memo_get(memo, FAR(6), 2, 0) == NULL);
+    assert(memo_get(memo, POS(6), 2, 0) == NULL);
+    e = memo_get(memo, POS(5), 1, 0);
+    assert(e != NULL && e->consumed == 3);
+
+    /* a base far into the address space keys from there */
+    memo_reset(memo);
+    memo_set_base(memo, FAR(0));
+    memo_set(memo, FAR(7), 1, NULL, 2, 0, MEMO_REACH_UNKNOWN);
+    e = memo_get(memo, FAR(7), 1, 0);
+    assert(e != NULL && e->consumed == 2);
+    assert(memo_get(memo, POS(7), 1, 0) == NULL);
+    memo_sweep(memo, FAR(8));
+    /* a retain table keeps its entries for the next parse */
+    assert((memo_get(memo, FAR(7), 1, 0) == NULL) == (type != MEMO_TYPE_RETAIN));
+    memo_dispose(memo);
+}
+
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+static void test_memo_point(void)
+{
+    MemoPoint idle = {}, busy = {};
+    unsigned i;
+    for (i = 0; i < MOZ_MEMO_POINT_PROBATION; i++) {
+        MEMO_POINT_LOOKUP(&idle);
+        MEMO_POINT_LOOKUP(&busy);
+        MEMO_POINT_HIT(&busy, 1);
+    }
+    assert(idle.disabled && idle.lookup == MOZ_MEMO_POINT_PROBATION);
+    assert(!busy.disabled && busy.hit == MOZ_MEMO_POINT_PROBATION);
+}
+#endif
+
+int main(int argc, char const* argv[])
+{
     NodeManager_init();
-    memo = memo_init(MOZ_MEMO_DEFAULT_WINDOW_SIZE, 4);
-#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
-    memo_set(memo, str, 0, NULL, 0, 0);
-    e = memo_get(memo, str, 0, 0);
-#else
-    memo_set(memo, 0, 0, NULL, 0, 0);
-    e = memo_get(memo, 0, 0, 0);
+    assert(sizeof(MemoEntry_t) == 16);
+    test_memo(MEMO_TYPE_DEFAULT);
+    test_memo(MEMO_TYPE_ELASTIC);
+    test_memo(MEMO_TYPE_HASH);
+    test_memo(MEMO_TYPE_ASSOC2);
+    test_memo(MEMO_TYPE_ASSOC4);
+    test_memo_edit();
+    if (sizeof(uintptr_t) > 4) {
+        test_memo_base(MEMO_TYPE_ELASTIC);
+        test_memo_base(MEMO_TYPE_HASH);
+        test_memo_base(MEMO_TYPE_ASSOC4);
+        test_memo_base(MEMO_TYPE_RETAIN);
+    }
+    assert(memo_type_parse("assoc4") == MEMO_TYPE_ASSOC4);
+    assert(memo_type_parse("retain") == MEMO_TYPE_RETAIN);
+    assert(memo_type_parse("lru") == -1);
+#ifdef MOZVM_MEMO_USE_POINT_PROFILE
+    test_memo_point();
 #endif
-    assert(e->result == NULL);
-    memo_dispose(memo);
     NodeManager_dispose();
     return 0;
 }
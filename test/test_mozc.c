@@ -0,0 +1,93 @@
+#include "libnez.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * A parser generated by mozc must parse a deep input as moz does, and end
+ * a too deep one with a stack overflow instead of running past its stack.
+ *   test_mozc input
+ * The parser is generated from test/json.nzc at build time; the input is
+ * a small JSON file (test/thread.json) that must parse.
+ */
+
+int json_parse(const char *input, size_t length, Node **node);
+
+#define DEPTH    5000
+#define TOO_DEEP (1000 * 1000)
+#define PADDING  64
+
+static int parse(const char *input, size_t length)
+{
+    Node *node = NULL;
+    int ret = json_parse(input, length, &node);
+    if (node) {
+        NODE_GC_RELEASE(node);
+    }
+    NodeManager_reset();
+    return ret;
+}
+
+static int parse_file(const char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    char *input;
+    long len;
+    int ret;
+
+    if (fp == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    input = (char *)VM_CALLOC(1, len + PADDING);
+    if (fread(input, 1, len, fp) != (size_t)len) {
+        len = -1;
+    }
+    fclose(fp);
+    ret = len < 0 ? -1 : parse(input, len);
+    VM_FREE(input);
+    return ret;
+}
+
+/* [[[...]]] */
+static int parse_deep(unsigned depth)
+{
+    char *input = (char *)VM_CALLOC(1, 2 * depth + PADDING);
+    int ret;
+    memset(input, '[', depth);
+    memset(input + depth, ']', depth);
+    ret = parse(input, 2 * depth);
+    VM_FREE(input);
+    return ret;
+}
+
+int main(int argc, char *const argv[])
+{
+    int ret;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s input\n", argv[0]);
+        return 1;
+    }
+    NodeManager_init();
+    if ((ret = parse_file(argv[1])) != 0) {
+        fprintf(stderr, "error: failed to parse '%s' (%d)\n", argv[1], ret);
+        return 1;
+    }
+    if ((ret = parse_deep(DEPTH)) != 0) {
+        fprintf(stderr, "error: %d deep input failed (%d)\n", DEPTH, ret);
+        return 1;
+    }
+    if ((ret = parse_deep(TOO_DEEP)) != 2) {
+        fprintf(stderr, "error: %d deep input did not overflow (%d)\n", TOO_DEEP, ret);
+        return 1;
+    }
+    /* an overflow leaves nothing behind for the next parse */
+    if ((ret = parse_deep(DEPTH)) != 0) {
+        fprintf(stderr, "error: %d deep input failed after overflow (%d)\n", DEPTH, ret);
+        return 1;
+    }
+    NodeManager_dispose();
+    return 0;
+}
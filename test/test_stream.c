@@ -0,0 +1,73 @@
+#include "mozvm.h"
+#include "loader.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * moz_runtime_parse_stream() parses one document after another, whatever
+ * whitespace separates them (NDJSON, concatenated JSON), including a
+ * document longer than the first read.
+ *   test_stream bytecode
+ * The bytecode is a JSON grammar (test/json.nzc); each document is parsed
+ * with its Value rule.
+ */
+
+#define DOCS "{\"a\": 1}\n{\"b\": 2}{\"c\": 3} [4]\r\n\n  \"s\"\t"
+#define NDOCS 5
+#define LONG_ITEMS (64 * 1024)
+
+int main(int argc, char *const argv[])
+{
+    mozvm_loader_t L = {};
+    moz_inst_t *head;
+    moz_stream_t S;
+    Node *node = NULL;
+    FILE *fp;
+    long parsed, size;
+    unsigned i, docs = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s bytecode\n", argv[0]);
+        return 1;
+    }
+    NodeManager_init();
+    if ((head = mozvm_loader_load_file(&L, argv[1])) == NULL) {
+        fprintf(stderr, "error: failed to load '%s'\n", argv[1]);
+        return 1;
+    }
+    /* the documents, then one list far longer than MOZ_STREAM_CHUNK_SIZE */
+    fp = tmpfile();
+    fputs(DOCS "\n[", fp);
+    for (i = 0; i < LONG_ITEMS; i++) {
+        fputs(i > 0 ? ", 1" : "1", fp);
+    }
+    fputs("]\n", fp);
+    fflush(fp);
+    size = ftell(fp);
+    rewind(fp);
+
+    moz_stream_init(&S, fileno(fp));
+    S.start = moz_runtime_find_nterm(L.R, "Value");
+    while ((parsed = moz_runtime_parse_stream(L.R, &S, head, &node)) == 0) {
+        if (node) {
+            NODE_GC_RELEASE(node);
+        }
+        docs++;
+    }
+    if (parsed != MOZVM_PARSE_END_OF_STREAM) {
+        fprintf(stderr, "error: parse failed at offset %lu (%ld)\n",
+                (unsigned long)(S.offset + S.begin), parsed);
+        return 1;
+    }
+    if (docs != NDOCS + 1 || S.offset + S.begin != (size_t)size) {
+        fprintf(stderr, "error: %u documents, %lu bytes\n",
+                docs, (unsigned long)(S.offset + S.begin));
+        return 1;
+    }
+    moz_stream_dispose(&S);
+    fclose(fp);
+    moz_runtime_dispose(L.R);
+    mozvm_loader_dispose(&L);
+    NodeManager_dispose();
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include "mozvm.h"
+#include "loader.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Runs one runtime per thread at the same time. Without arguments every
+ * thread builds and memoizes ast nodes by hand; given a bytecode and an
+ * input file every thread also attaches a runtime to the program loaded
+ * once by the main thread and parses the input, and all of them must
+ * agree with a parse done before the threads start. The program is
+ * refcounted; only the loader may hold it once the threads are done.
+ *   test_thread [bytecode input]
+ */
+
+#define THREADS 8
+#define ROUNDS  500
+#define WIDTH   64
+#define MEMO_SIZE 4
+
+#ifdef MOZVM_USE_POINTER_AS_POS_REGISTER
+#define POS(S, N) ((S) + (N))
+#else
+#define POS(S, N) (N)
+#endif
+
+#define CHECK(W, COND) do { \
+    if (!(COND)) { \
+        fprintf(stderr, "thread %u: check failed: %s\n", (W)->id, #COND); \
+        (W)->errors++; \
+    } \
+} while (0)
+
+typedef struct worker {
+    pthread_t thread;
+    unsigned id;
+    unsigned errors;
+    char input[WIDTH + 1];
+} worker_t;
+
+static mozvm_loader_t loader = {};
+static long expected_result = -1;
+static unsigned expected_length = 0;
+
+static void build_tree(worker_t *w, moz_runtime_t *r)
+{
+    const char *str = w->input;
+    AstMachine *ast = r->ast;
+    MemoEntry_t *e;
+    Node *node, *child;
+    unsigned i;
+
+    moz_runtime_set_source(r, str, str + WIDTH);
+    ast_log_new(ast, POS(str, 0));
+    for (i = 0; i < WIDTH; i++) {
+        long tx = ast_save_tx(ast);
+        ast_log_new(ast, POS(str, i));
+        ast_log_capture(ast, POS(str, i + 1));
+        ast_commit_tx(ast, NULL, tx);
+        child = ast_get_last_linked_node(ast);
+        memo_set(r->memo, POS(str, i), i % MEMO_SIZE, child, 1, 0, MEMO_REACH_UNKNOWN);
+    }
+    ast_log_capture(ast, POS(str, WIDTH));
+    node = ast_get_parsed_node(ast);
+
+    CHECK(w, node != NULL && Node_length(node) == WIDTH);
+    CHECK(w, node->pos == str && node->len == WIDTH);
+    for (i = 0; i < WIDTH; i++) {
+        child = Node_get(node, i);
+        CHECK(w, child->pos == str + i && child->len == 1);
+        /* the table may have evicted it, but a hit must be this node */
+        e = memo_get(r->memo, POS(str, i), i % MEMO_SIZE, 0);
+        CHECK(w, e == NULL || memo_entry_result(r->memo, e) == child);
+    }
+    CHECK(w, memo_get(r->memo, POS(str, WIDTH - 1), (WIDTH - 1) % MEMO_SIZE, 0) != NULL);
+    NODE_GC_RELEASE(node);
+    moz_runtime_reuse(r);
+    CHECK(w, memo_get(r->memo, POS(str, WIDTH - 1), (WIDTH - 1) % MEMO_SIZE, 0) == NULL);
+}
+
+static unsigned count_nodes(Node *node)
+{
+    unsigned i, count = 1;
+    for (i = 0; i < Node_length(node); i++) {
+        count += count_nodes(Node_get(node, i));
+    }
+    return count;
+}
+
+/* parses the input and returns the number of nodes in the tree, 0 on error */
+static unsigned parse_input(moz_runtime_t *r, moz_inst_t *head, long *parsed)
+{
+    moz_inst_t *inst;
+    Node *node;
+    unsigned length = 0;
+    moz_runtime_set_source(r, loader.input, loader.input + loader.input_size);
+    inst = moz_runtime_parse_init(r, loader.input, head);
+    *parsed = moz_runtime_parse(r, loader.input, inst);
+    if (*parsed == 0 && (node = ast_get_parsed_node(r->ast)) != NULL) {
+        length = count_nodes(node);
+        NODE_GC_RELEASE(node);
+    }
+    moz_runtime_reuse(r);
+    return length;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    moz_runtime_t *r;
+    unsigned i;
+
+    NodeManager_init();
+    r = moz_runtime_init(MEMO_SIZE, 1, MEMO_TYPE_DEFAULT);
+    for (i = 0; i < ROUNDS; i++) {
+        build_tree(w, r);
+    }
+    moz_runtime_dispose(r);
+
+    if (loader.program) {
+        moz_program_t *p = loader.program;
+        long parsed;
+        r = moz_runtime_init(p->C.memo_size, p->C.nterm_size, MEMO_TYPE_DEFAULT);
+        moz_runtime_attach(r, p);
+#ifdef MOZVM_ENABLE_JIT
+        /* code one worker compiled is run by all of them */
+        moz_runtime_enable_jit(r, 1);
+#endif
+        CHECK(w, r->program == p && p->refc > 1);
+        for (i = 0; i < ROUNDS / 50; i++) {
+            unsigned length = parse_input(r, p->inst, &parsed);
+            CHECK(w, parsed == expected_result && length == expected_length);
+        }
+        moz_runtime_dispose(r);
+    }
+    NodeManager_dispose();
+    return NULL;
+}
+
+int main(int argc, char const* argv[])
+{
+    worker_t workers[THREADS];
+    unsigned i, errors = 0;
+
+    NodeManager_init();
+    if (argc == 3) {
+        moz_inst_t *head;
+        if (!mozvm_loader_load_input(&loader, argv[2]) ||
+                (head = mozvm_loader_load_file(&loader, argv[1])) == NULL) {
+            fprintf(stderr, "error: failed to load '%s' or '%s'\n",
+                    argv[1], argv[2]);
+            return 1;
+        }
+        expected_length = parse_input(loader.R, head, &expected_result);
+        if (expected_result != 0 || expected_length == 0) {
+            fprintf(stderr, "error: failed to parse '%s'\n", argv[2]);
+            return 1;
+        }
+        /* the workers share the program, not this runtime */
+        moz_runtime_dispose(loader.R);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        w->errors = 0;
+        memset(w->input, 'a' + i, WIDTH);
+        w->input[WIDTH] = '\0';
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "error: pthread_create failed\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(workers[i].thread, NULL);
+        errors += workers[i].errors;
+    }
+#ifdef MOZVM_ENABLE_JIT
+    if (loader.program) {
+        /* the workers requested code from the program they share */
+        unsigned requested = 0;
+        for (i = 0; i < loader.program->C.nterm_size; i++) {
+            requested += loader.program->nterm_entry[i].state != MOZVM_JIT_STATE_NONE;
+        }
+        if (requested == 0) {
+            fprintf(stderr, "error: no nterm was compiled\n");
+            errors++;
+        }
+    }
+#endif
+    /* every worker runtime has dropped its reference to the program */
+    if (loader.program && loader.program->refc != 1) {
+        fprintf(stderr, "error: program refc is %ld\n", loader.program->refc);
+        errors++;
+    }
+    mozvm_loader_dispose(&loader);
+    NodeManager_dispose();
+    return errors != 0;
+}
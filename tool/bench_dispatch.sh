@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# Compare indirect-threaded (moz) and direct-threaded (moz_direct) dispatch.
+# usage: sh tool/bench_dispatch.sh [build_dir] [loop] [input_dir]
+# input_dir holds the benchmark inputs (citys.json, ...) and defaults to
+# test_vm/bench/input; inputs or bytecodes that are missing are skipped.
+# Without any of them, the json test grammar and input under test/ are used.
+
+BUILD=Release
+LOOP=5
+BENCH=test_vm/bench/input
+if [ $# -ge 1 ]; then
+    BUILD=$1
+fi
+if [ $# -ge 2 ]; then
+    LOOP=$2
+fi
+if [ $# -ge 3 ]; then
+    BENCH=$3
+fi
+RAN=0
+
+run() {
+    if [ ! -f "$1" ] || [ ! -f "$2" ]; then
+        echo "skip $1 (missing $1 or $2)"
+        return
+    fi
+    echo "$1"
+    for VM in moz moz_direct; do
+        printf "  %-10s" ${VM}
+        ./${BUILD}/${VM} -n ${LOOP} -q -s -p $2 -i $1 2>&1 | tail -1
+    done
+    RAN=1
+}
+
+run ${BENCH}/citys.json         sample/old_json.nzc
+run ${BENCH}/earthquake.geojson sample/old_json.nzc
+run ${BENCH}/benchmark4.json    sample/old_json.nzc
+run ${BENCH}/xmark5m.xml        sample/xml.nzc
+if [ ${RAN} = 0 ]; then
+    run test/thread.json test/json.nzc
+fi